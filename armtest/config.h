@@ -4,12 +4,29 @@
 /* Define to set up for debugging */
 #define DEBUG 1
 
+/* Define to 1 if you have the declaration of
+   `MEMBARRIER_CMD_PRIVATE_EXPEDITED', and to 0 if you don't. */
+#define HAVE_DECL_MEMBARRIER_CMD_PRIVATE_EXPEDITED 1
+
+/* Define to 1 if you have the declaration of
+   `MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE', and to 0 if you don't. */
+#define HAVE_DECL_MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE 1
+
 /* Define to 1 if you don't have `vprintf' but do have `_doprnt.' */
 /* #undef HAVE_DOPRNT */
 
 /* Define to 1 if you have the `getpagesize' function. */
 #define HAVE_GETPAGESIZE 1
 
+/* Define to 1 if you have the `pthread' library (-lpthread). */
+#define HAVE_LIBPTHREAD 1
+
+/* Define to 1 if you have the <linux/membarrier.h> header file. */
+#define HAVE_LINUX_MEMBARRIER_H 1
+
+/* Define to 1 if you have the `memfd_create' function. */
+#define HAVE_MEMFD_CREATE 1
+
 /* Define to 1 if you have the `mmap' function. */
 #define HAVE_MMAP 1
 
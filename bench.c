@@ -0,0 +1,274 @@
+#include "config.h"
+#include "vm.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+/* Compile speed with several threads: each thread compiles a mixture
+   of procedures like those in fact.c, and we report procedures and
+   bytes per second and the 99th percentile of the time to compile one
+   procedure, as the number of threads goes up to the number of cores.
+   Where the speed does not grow with the threads, the number of times
+   a thread had to wait for the code allocator shows whether that is
+   to blame. */
+
+typedef int (*funcp)(int);
+
+static float a[] = { 3.0, 1.0, 4.0, 1.0, 5.0, 9.0 };
+
+/* loop -- a loop like fact, with k more operations in the body */
+static void *loop(int k) {
+     void *entry;
+     vmlabel lab1 = vm_newlab(), lab2 = vm_newlab();
+     vmreg r0 = vm_ireg[0], r1 = vm_ireg[1], r2 = vm_ireg[2];
+
+     entry = vm_begin("loop", 1);
+     vm_gen(GETARG, r0, 0);
+     vm_gen(MOV, r1, 1);
+     vm_gen(MOV, r2, 0);
+
+     vm_label(lab1);
+     vm_gen(BEQ, r0, 0, lab2);
+     vm_gen(MUL, r1, r1, r0);
+     for (int i = 0; i < k; i++) {
+          vm_gen(ADD, r2, r2, r0);
+          vm_gen(XOR, r2, r2, i);
+          vm_gen(LSH, r2, r2, 1);
+     }
+     vm_gen(SUB, r0, r0, 1);
+     vm_gen(JUMP, lab1);
+
+     vm_label(lab2);
+     vm_gen(MOV, vm_ret, r1);
+     vm_end();
+     return entry;
+}
+
+/* recurse -- a recursive procedure like fact2, that also calls g */
+static void *recurse(void *g) {
+     void *entry;
+     vmlabel lab1 = vm_newlab(), lab2 = vm_newlab();
+     vmreg r0 = vm_ireg[0], r1 = vm_ireg[1];
+
+     entry = vm_begin_locals("recurse", 1, 4);
+     vm_gen(GETARG, r0, 0);
+
+     vm_gen(BNE, r0, 0, lab1);
+     vm_gen(MOV, vm_ret, 1);
+     vm_gen(JUMP, lab2);
+
+     vm_label(lab1);
+     vm_gen(STW, r0, vm_base, 0);
+     vm_gen(PREP, 1);
+     vm_gen(ARG, r0);
+     vm_gen(CALL, g);
+     vm_gen(LDW, r0, vm_base, 0);
+     vm_gen(SUB, r1, r0, 1);
+     vm_gen(PREP, 1);
+     vm_gen(ARG, r1);
+     vm_gen(CALL, entry);
+     vm_gen(LDW, r0, vm_base, 0);
+     vm_gen(MUL, vm_ret, r0, vm_ret);
+
+     vm_label(lab2);
+     vm_end();
+     return entry;
+}
+
+/* cases -- a jump table with n cases */
+static void *cases(int n) {
+     void *entry;
+     vmlabel *lab = (vmlabel *) vm_scratch(n * sizeof(vmlabel));
+     vmlabel done = vm_newlab();
+     vmreg r0 = vm_ireg[0], r1 = vm_ireg[1], r2 = vm_ireg[2];
+
+     for (int i = 0; i < n; i++) lab[i] = vm_newlab();
+
+     entry = vm_begin("cases", 1);
+     vm_gen(GETARG, r0, 0);
+     vm_gen(MOV, vm_ret, -1);
+     vm_gen(BGEu, r0, n, done);
+     int t = vm_jumptable(n);
+     for (int i = 0; i < n; i++) vm_caselab(lab[i]);
+     vm_gen(MOV, r2, t);
+     vm_gen(LDW, r1, r2, r0, 2);
+     vm_gen(JUMP, r1);
+
+     for (int i = 0; i < n; i++) {
+          vm_label(lab[i]);
+          vm_gen(MUL, vm_ret, r0, i+1);
+          vm_gen(JUMP, done);
+     }
+
+     vm_label(done);
+     vm_end();
+     return entry;
+}
+
+/* sum -- add up the array, like the sum procedure in fact.c */
+static void *sum(float *aa) {
+     void *entry;
+     vmlabel lab1 = vm_newlab(), lab2 = vm_newlab();
+     vmreg n = vm_ireg[0], i = vm_ireg[1], t = vm_ireg[2], y = vm_ireg[3];
+     vmreg s = vm_freg[0], x = vm_freg[1];
+
+     entry = vm_begin("sum", 2);
+     vm_gen(GETARG, n, 0);
+     vm_gen(GETARG, y, 1);
+
+     vm_gen(MOV, i, 0);
+     vm_gen(ZEROf, s);
+     vm_label(lab1);
+     vm_gen(BGE, i, n, lab2);
+     vm_gen(LSH, t, i, 2);
+     vm_gen(LDW, x, t, vm_addr(aa));
+     vm_gen(MULf, x, x, x);
+     vm_gen(ADDf, s, s, x);
+     vm_gen(ADD, i, i, 1);
+     vm_gen(JUMP, lab1);
+     vm_label(lab2);
+     vm_gen(STW, s, y);
+     vm_end();
+     return entry;
+}
+
+#define NKIND 4
+
+/* Results for one thread */
+struct worker {
+     int w_nprocs;              /* Procedures to compile */
+     void **w_entry;            /* Their entry addresses */
+     long *w_nsec;              /* Time taken for each */
+     int w_bad;                 /* Wrong answers from the code */
+};
+
+static long now(void) {
+     struct timespec t;
+     clock_gettime(CLOCK_MONOTONIC, &t);
+     return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+/* work -- compile a mixture of procedures and check a few of them */
+static void *work(void *arg) {
+     struct worker *w = arg;
+     float *aa = (float *) vm_literal(sizeof(a));
+     float *y = (float *) vm_literal(sizeof(float));
+     void *last[NKIND];
+
+     memcpy(aa, a, sizeof(a));
+     w->w_bad = 0;
+
+     for (int i = 0; i < w->w_nprocs; i++) {
+          int kind = i % NKIND;
+          long t0 = now();
+          void *p;
+
+          switch (kind) {
+          case 0: p = loop(i % 37); break;
+          case 1: p = recurse(last[0]); break;
+          case 2: p = cases(4 + i % 29); break;
+          default: p = sum(aa); break;
+          }
+
+          w->w_nsec[i] = now() - t0;
+          w->w_entry[i] = last[kind] = p;
+     }
+
+     if (w->w_nprocs >= NKIND) {
+          if (((funcp) last[0])(5) != 120) w->w_bad++;
+          if (((funcp) last[1])(3) != 6) w->w_bad++;
+          if (((funcp) last[2])(3) != 12) w->w_bad++;
+          ((void (*)(int, float *)) last[3])(6, y);
+          if (*y != 133.0) w->w_bad++;
+     }
+
+     vm_end_thread();
+     return NULL;
+}
+
+static int cmplong(const void *a, const void *b) {
+     long x = * (const long *) a, y = * (const long *) b;
+     return (x < y ? -1 : x > y ? 1 : 0);
+}
+
+/* run -- compile with nthreads threads and print a line of results;
+   return the procedures per second */
+static double run(int nthreads, int nprocs, double base) {
+     struct worker *w = (struct worker *) calloc(nthreads, sizeof(struct worker));
+     long *all = (long *) malloc(nthreads * nprocs * sizeof(long));
+     struct vm_stats s0, s1;
+     long bytes = 0, t0, t1;
+     int bad = 0;
+
+     for (int k = 0; k < nthreads; k++) {
+          w[k].w_nprocs = nprocs;
+          w[k].w_entry = (void **) malloc(nprocs * sizeof(void *));
+          w[k].w_nsec = all + k * nprocs;
+     }
+
+     vm_stats(&s0);
+     t0 = now();
+#ifdef HAVE_LIBPTHREAD
+     pthread_t *tid = (pthread_t *) malloc(nthreads * sizeof(pthread_t));
+     for (int k = 0; k < nthreads; k++)
+          pthread_create(&tid[k], NULL, work, &w[k]);
+     for (int k = 0; k < nthreads; k++)
+          pthread_join(tid[k], NULL);
+     free(tid);
+#else
+     work(&w[0]);
+#endif
+     t1 = now();
+     vm_stats(&s1);
+
+     /* A procedure may continue in another block, so vm_procsize
+        cannot be trusted for its size */
+     for (int k = 0; k < nthreads; k++) {
+          bad += w[k].w_bad;
+          for (int i = 0; i < nprocs; i++) {
+               struct vm_procstats ps;
+               if (vm_procstats(w[k].w_entry[i], &ps)) bytes += ps.code;
+               vm_free_proc(w[k].w_entry[i]);
+          }
+          free(w[k].w_entry);
+     }
+
+     int n = nthreads * nprocs;
+     double secs = (t1 - t0) / 1e9, rate = n / secs;
+     double waits = (double) (s1.lock_waits - s0.lock_waits) / n;
+     double eff = (base > 0 ? rate / (nthreads * base) : 1.0);
+     qsort(all, n, sizeof(long), cmplong);
+
+     printf("%7d %10.0f %10.0f %9.1f %11.3f %9.2f%s%s\n",
+            nthreads, rate, bytes / secs / 1024, all[n - 1 - n/100] / 1e3,
+            waits, eff, (bad > 0 ? "  WRONG ANSWERS" : ""),
+            (eff < 0.7 ? (waits > 0.1 ? "  allocator lock"
+                          : "  shared state") : ""));
+
+     free(all); free(w);
+     return rate;
+}
+
+int main(int argc, char *argv[]) {
+     int nprocs = (argc > 1 ? atoi(argv[1]) : 4000);
+     int ncores = (argc > 2 ? atoi(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN));
+     double base;
+
+#ifndef HAVE_LIBPTHREAD
+     ncores = 1;
+#endif
+     if (ncores < 1) ncores = 1;
+
+     printf("%d procedures per thread\n", nprocs);
+     printf("threads    procs/s     KB/s   p99(us) waits/proc  scaling\n");
+     base = run(1, nprocs, 0.0);
+     for (int t = 2; t < ncores; t *= 2) run(t, nprocs, base);
+     if (ncores > 1) run(ncores, nprocs, base);
+     return 0;
+}
@@ -0,0 +1,321 @@
+#include "config.h"
+#include "vm.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Compile procedures with vm_defer under every combination of the
+   passes, and check that each gives the same results as a C function
+   that does the same job.  Then check a patchable site, a job and a
+   compaction.  Prints the failures and exits with status 1 if there
+   are any. */
+
+typedef int (*funcp)(int);
+
+static int failures = 0;
+
+/* expect -- report a result that is not as expected */
+static void expect(const char *what, int arg, int got, int want) {
+     if (got == want) return;
+     printf("%s(%d) = %d, expected %d\n", what, arg, got, want);
+     failures++;
+}
+
+/* coldentry -- the entry block starts with a label marked cold, and
+   must still come first when the blocks are laid out */
+static void *coldentry(void) {
+     void *entry;
+     vmlabel lab1 = vm_newlab(), lab2 = vm_newlab(), lab3 = vm_newlab();
+     vmreg r0 = vm_ireg[0];
+
+     entry = vm_begin("coldentry", 1);
+     vm_label(lab1);
+     vm_cold(lab1);
+     vm_gen(GETARG, r0, 0);
+     vm_gen(BEQ, r0, 0, lab2);
+     vm_gen(MOV, vm_ret, 1);
+     vm_gen(JUMP, lab3);
+     vm_label(lab2);
+     vm_weight(lab2, 10);
+     vm_gen(MOV, vm_ret, 2);
+     vm_label(lab3);
+     vm_weight(lab3, 5);
+     vm_end();
+     return entry;
+}
+
+static int c_coldentry(int x) {
+     return (x != 0 ? 1 : 2);
+}
+
+/* sumto -- a loop in virtual registers */
+static void *sumto(void) {
+     void *entry;
+     vmlabel lab1 = vm_newlab(), lab2 = vm_newlab();
+
+     entry = vm_begin("sumto", 1);
+     vmreg n = vm_newreg(VM_INT), s = vm_newreg(VM_INT);
+     vm_gen(GETARG, n, 0);
+     vm_gen(MOV, s, 0);
+     vm_label(lab1);
+     vm_weight(lab1, 100);
+     vm_gen(BLE, n, 0, lab2);
+     vm_gen(ADD, s, s, n);
+     vm_gen(SUB, n, n, 1);
+     vm_gen(JUMP, lab1);
+     vm_label(lab2);
+     vm_gen(MOV, vm_ret, s);
+     vm_end();
+     return entry;
+}
+
+static int c_sumto(int x) {
+     return (x > 0 ? x * (x+1) / 2 : 0);
+}
+
+/* fact -- recursive factorial, with the argument kept in a virtual
+   register across the call */
+static void *fact(void) {
+     void *entry;
+     vmlabel lab1 = vm_newlab(), lab2 = vm_newlab();
+
+     entry = vm_begin("fact", 1);
+     vmreg n = vm_newreg(VM_INT), t = vm_newreg(VM_INT);
+     vm_gen(GETARG, n, 0);
+     vm_gen(BGT, n, 0, lab1);
+     vm_gen(MOV, vm_ret, 1);
+     vm_gen(JUMP, lab2);
+     vm_label(lab1);
+     vm_weight(lab1, 10);
+     vm_gen(SUB, t, n, 1);
+     vm_gen(PREP, 1);
+     vm_gen(ARG, t);
+     vm_gen(CALL, entry);
+     vm_gen(MUL, vm_ret, n, vm_ret);
+     vm_label(lab2);
+     vm_end();
+     return entry;
+}
+
+static int c_fact(int x) {
+     return (x > 0 ? x * c_fact(x-1) : 1);
+}
+
+/* constants -- arithmetic and a branch that vm_fold can do at once */
+static void *constants(void) {
+     void *entry;
+     vmlabel lab1 = vm_newlab(), lab2 = vm_newlab();
+     vmreg r0 = vm_ireg[0];
+
+     entry = vm_begin("constants", 1);
+     vmreg a = vm_newreg(VM_INT), b = vm_newreg(VM_INT);
+     vm_gen(GETARG, r0, 0);
+     vm_gen(MOV, a, 6);
+     vm_gen(MUL, b, a, 7);
+     vm_gen(BEQ, a, 6, lab1);
+     vm_gen(MOV, vm_ret, -1);
+     vm_gen(JUMP, lab2);
+     vm_label(lab1);
+     vm_gen(ADD, vm_ret, r0, b);
+     vm_label(lab2);
+     vm_end();
+     return entry;
+}
+
+static int c_constants(int x) {
+     return x + 42;
+}
+
+/* jumps -- a branch over a jump, a label followed by a jump, dead
+   stores and a block that cannot be reached */
+static void *jumps(void) {
+     void *entry;
+     vmlabel lab1 = vm_newlab(), lab2 = vm_newlab(), lab3 = vm_newlab(),
+          lab4 = vm_newlab(), lab5 = vm_newlab();
+     vmreg r0 = vm_ireg[0], r1 = vm_ireg[1];
+
+     entry = vm_begin("jumps", 1);
+     vm_gen(GETARG, r0, 0);
+     vm_gen(MOV, r1, 99);
+     vm_gen(MOV, r1, 0);
+     vm_gen(BNE, r0, 0, lab1);
+     vm_gen(JUMP, lab3);
+     vm_label(lab1);
+     vm_gen(BLT, r0, 5, lab2);
+     vm_gen(MOV, r1, 2);
+     vm_gen(JUMP, lab4);
+     vm_gen(ADD, r1, r1, 1000);
+     vm_label(lab2);
+     vm_gen(MOV, r1, 1);
+     vm_label(lab4);
+     vm_gen(JUMP, lab5);
+     vm_label(lab3);
+     vm_gen(MOV, r1, 3);
+     vm_label(lab5);
+     vm_gen(MOV, vm_ret, r1);
+     vm_end();
+     return entry;
+}
+
+static int c_jumps(int x) {
+     return (x == 0 ? 3 : x < 5 ? 1 : 2);
+}
+
+/* switcher -- a jump table, with counts that reorder the cases */
+static void *switcher(void) {
+     void *entry;
+     vmlabel lab[4], done = vm_newlab();
+     vmreg r0 = vm_ireg[0], r1 = vm_ireg[1], r2 = vm_ireg[2];
+
+     for (int i = 0; i < 4; i++) lab[i] = vm_newlab();
+
+     entry = vm_begin("switcher", 1);
+     vm_gen(GETARG, r0, 0);
+     vm_gen(MOV, vm_ret, -1);
+     vm_gen(BGEu, r0, 4, done);
+     int t = vm_jumptable(4);
+     for (int i = 0; i < 4; i++) vm_caselab(lab[i]);
+     vm_gen(MOV, r2, t);
+     vm_gen(LDW, r1, r2, r0, 2);
+     vm_gen(JUMP, r1);
+     for (int i = 0; i < 4; i++) {
+          vm_label(lab[i]);
+          vm_gen(ADD, vm_ret, r0, 10*(i+1));
+          vm_gen(JUMP, done);
+     }
+     vm_label(done);
+     vm_cold(lab[0]);
+     vm_weight(lab[3], 50);
+     vm_weight(done, 20);
+     vm_end();
+     return entry;
+}
+
+static int c_switcher(int x) {
+     return (x >= 0 && x < 4 ? x + 10*(x+1) : -1);
+}
+
+static struct {
+     const char *name;
+     void *(*compile)(void);
+     int (*model)(int);
+} test[] = {
+     { "coldentry", coldentry, c_coldentry },
+     { "sumto", sumto, c_sumto },
+     { "fact", fact, c_fact },
+     { "constants", constants, c_constants },
+     { "jumps", jumps, c_jumps },
+     { "switcher", switcher, c_switcher },
+     { NULL, NULL, NULL }
+};
+
+/* increment -- a procedure that adds k to its argument */
+static void *increment(int k) {
+     void *entry;
+     vmreg r0 = vm_ireg[0];
+
+     entry = vm_begin("increment", 1);
+     vm_gen(GETARG, r0, 0);
+     vm_gen(ADD, vm_ret, r0, k);
+     vm_end();
+     return entry;
+}
+
+/* checksite -- call through a site, then retarget it */
+static void checksite(void) {
+     void *inc1 = increment(1), *inc2 = increment(2);
+     vmreg r0 = vm_ireg[0];
+     funcp fp;
+     int s;
+
+     fp = (funcp) vm_begin("site", 1);
+     vm_gen(GETARG, r0, 0);
+     vm_gen(PREP, 1);
+     vm_gen(ARG, r0);
+     s = vm_site(CALL, inc1);
+     vm_end();
+
+     expect("site", 5, (*fp)(5), 6);
+     vm_retarget(fp, s, inc2);
+     expect("retarget", 5, (*fp)(5), 7);
+     vm_free_proc(fp);
+     vm_free_proc(inc1);
+     vm_free_proc(inc2);
+}
+
+static int c_slow(int x) {
+     return x + 100;
+}
+
+/* compile_job -- compile the procedure for a job */
+static void *compile_job(void *arg) {
+     return increment(100);
+}
+
+static void *factp;             /* Entry of fact while compacting */
+static int nmoved;
+
+/* moved -- callback from vm_compact */
+static void moved(void *old, void *new) {
+     if (old == factp) factp = new;
+     nmoved++;
+}
+
+/* checkmove -- compile a job and fact after some procedures that are
+   then freed, so that compacting moves them; both must still work,
+   through the job stub as well, and be found at their new address */
+static void checkmove(void) {
+     void *filler[20];
+     struct vm_procinfo info;
+     int n;
+
+     for (int i = 0; i < 20; i++) filler[i] = sumto();
+     vmjob j = vm_submit(compile_job, NULL, (funptr) c_slow, 0);
+     funcp stub = (funcp) vm_job_entry(j);
+     expect("job", 5, (*(funcp) vm_wait(j))(5), 105);
+     expect("jobstub", 5, (*stub)(5), 105);
+     factp = fact();
+
+     for (int i = 0; i < 20; i++) vm_free_proc(filler[i]);
+     n = vm_compact(moved);
+     expect("compact", 0, n > 0, 1);
+     expect("callbacks", 0, nmoved, n);
+
+     expect("moved fact", 5, (*(funcp) factp)(5), 120);
+     expect("moved job", 5, (*(funcp) vm_wait(j))(5), 105);
+     expect("moved jobstub", 5, (*stub)(5), 105);
+     expect("lookup", 0, vm_lookup_pc(factp, &info)
+            && info.entry == factp && strcmp(info.name, "fact") == 0, 1);
+
+     vm_free_proc(factp);
+     vm_free_job(j);
+}
+
+static int *pass[] = { &vm_fold, &vm_jumps, &vm_deadcode, &vm_layout };
+#define NPASS (sizeof(pass) / sizeof(pass[0]))
+
+int main(int argc, char *argv[]) {
+     char what[64];
+
+     vm_defer = 1;
+     for (unsigned m = 0; m < 1 << NPASS; m++) {
+          for (int k = 0; k < NPASS; k++)
+               *pass[k] = (m >> k) & 1;
+
+          for (int i = 0; test[i].name != NULL; i++) {
+               funcp fp = (funcp) (*test[i].compile)();
+               sprintf(what, "%s/%x", test[i].name, m);
+               for (int x = -3; x <= 10; x++)
+                    expect(what, x, (*fp)(x), (*test[i].model)(x));
+               vm_free_proc(fp);
+          }
+     }
+
+     for (int k = 0; k < NPASS; k++) *pass[k] = 1;
+     checksite();
+     checkmove();
+
+     if (failures > 0) return 1;
+     printf("All checks passed\n");
+     return 0;
+}
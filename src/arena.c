@@ -0,0 +1,362 @@
+/*
+ * arena.c
+ * 
+ * This file is part of the Oxford Oberon-2 compiler
+ * Copyright (c) 2006--2016 J. M. Spivey
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include "config.h"
+#include "vm.h"
+#include "vminternal.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
+/* Where the system allows it, code lives in an arena that is mapped
+   twice: the emitter writes through a read-write view, and the code
+   runs from a read-execute view of the same memory.  No page is ever
+   writable and executable at once, and after the arena is set up,
+   compiling makes no calls to change protection.  The two views are
+   a fixed distance vm_xoff apart, so pc and other emitter addresses
+   are in the writable view, and xaddr() translates them into the
+   executable view for labels, entry points and relative branches.
+
+   Literals and jump tables live in a second arena, kept away from the
+   code.  It also has two views: one that is writable, and one that is
+   read-only and a distance vm_doff away, so that tables made by the
+   compiler can be read but not altered by the code.  Literals made by
+   the client are used through the writable view.
+
+   When an arena is full, another of the same size is mapped in the
+   same way, so that its views are the same distance apart. */
+
+ptr vm_xoff;                    /* Executable minus writable address */
+ptr vm_doff;                    /* Read-only minus writable address */
+
+#define ARENA (64<<20)          /* Default size of code arena */
+#define DATAFRAC 4              /* Code arena size / data arena size */
+
+#define HUGEPAGE (2<<20)        /* Size of a huge page */
+
+static struct arena {
+     code_addr a_base;          /* Writable view */
+     int a_size;                /* Size of each view */
+     int a_align;               /* Granule for giving back pages */
+     struct arena *a_next;      /* Next arena of the same kind */
+} arena[2];
+
+static int arena_state;         /* 0 = not set up, 1 = settled */
+
+#ifdef HAVE_MEMFD_CREATE
+#include <unistd.h>
+
+#ifdef M64X32
+#define MMAP_FLAGS MAP_PRIVATE|MAP_ANONYMOUS|MAP_32BIT
+#else
+#define MMAP_FLAGS MAP_PRIVATE|MAP_ANONYMOUS
+#endif
+
+/* map_views -- map a file twice, side by side and suitably aligned */
+static int map_views(struct arena *ar, int fd, int size, int align,
+                     int prot) {
+     /* Reserve enough address space to align the pair of views, then
+        map them over the reservation */
+     ptr total = 2 * (ptr) size + align;
+     void *r = mmap(NULL, total, PROT_NONE, MMAP_FLAGS, -1, 0);
+     if (r == MAP_FAILED) return 0;
+
+     code_addr a =
+          (code_addr) (((ptr) r + align - 1) & ~(ptr) (align-1));
+     code_addr z = (code_addr) r + total;
+     if (a > (code_addr) r) munmap(r, a - (code_addr) r);
+     if (z > a + 2*(ptr) size) munmap(a + 2*(ptr) size, z - (a + 2*(ptr) size));
+
+#ifdef M64X32
+     if ((((unsigned long) a + 2*(ptr) size) & ~0x7fffffff) != 0) {
+          munmap(a, 2*(ptr) size);
+          return 0;
+     }
+#endif
+
+     void *w = mmap(a, size, PROT_READ|PROT_WRITE,
+                    MAP_SHARED|MAP_FIXED, fd, 0);
+     void *x = mmap(a + size, size, prot, MAP_SHARED|MAP_FIXED, fd, 0);
+     if (w == MAP_FAILED || x == MAP_FAILED) {
+          munmap(a, 2*(ptr) size);
+          return 0;
+     }
+
+     ar->a_base = a; ar->a_size = size; ar->a_align = align;
+     return 1;
+}
+
+/* map_file -- make a file of the right size and map it */
+static int map_file(struct arena *ar, int size, int align, int prot,
+                    unsigned flags) {
+     int fd = memfd_create("thunder", MFD_CLOEXEC|flags);
+     if (fd < 0) return 0;
+
+     int ok = (ftruncate(fd, size) == 0
+               && map_views(ar, fd, size, align, prot));
+     close(fd);
+     return ok;
+}
+
+/* map_code -- create the code arena */
+static int map_code(int size, int flags) {
+     struct arena *ar = &arena[CODEMEM];
+     int prot = PROT_READ|PROT_EXEC;
+
+     if (flags & VM_HUGE) {
+          size = (size + HUGEPAGE - 1) & ~(HUGEPAGE-1);
+
+#ifdef MFD_HUGETLB
+          /* Use reserved huge pages if there are any */
+          if (map_file(ar, size, HUGEPAGE, prot, MFD_HUGETLB)) goto done;
+#endif
+
+          /* Otherwise ask for transparent huge pages */
+          if (!map_file(ar, size, HUGEPAGE, prot, 0)) return 0;
+#ifdef MADV_HUGEPAGE
+          madvise(ar->a_base, 2*(ptr) size, MADV_HUGEPAGE);
+#endif
+     } else {
+          size = (size + PAGESIZE - 1) & ~(PAGESIZE-1);
+          if (!map_file(ar, size, PAGESIZE, prot, 0)) return 0;
+     }
+
+done:
+     vm_xoff = ar->a_size;
+     return 1;
+}
+
+/* map_data -- create the data arena */
+static int map_data(int size) {
+     struct arena *ar = &arena[DATAMEM];
+     size = (size + PAGESIZE - 1) & ~(PAGESIZE-1);
+     if (!map_file(ar, size, PAGESIZE, PROT_READ, 0)) return 0;
+     vm_doff = ar->a_size;
+     return 1;
+}
+
+/* map_arena -- create both arenas */
+static int map_arena(int size, int flags) {
+     if (!map_code(size, flags)) return 0;
+     map_data(size / DATAFRAC);
+     return 1;
+}
+
+/* vm_more_arena -- add an arena of a kind with room for n bytes */
+int vm_more_arena(int kind, int n, code_addr *base, int *size) {
+     struct arena *ar = &arena[kind], *x;
+     int prot = (kind == CODEMEM ? PROT_READ|PROT_EXEC : PROT_READ);
+
+     if (ar->a_base == NULL || n > ar->a_size) return 0;
+
+     x = (struct arena *) malloc(sizeof(struct arena));
+     if (x == NULL) return 0;
+     if (!map_file(x, ar->a_size, ar->a_align, prot, 0)) {
+          free(x);
+          return 0;
+     }
+#ifdef MADV_HUGEPAGE
+     if (x->a_align > PAGESIZE)
+          madvise(x->a_base, 2*(ptr) x->a_size, MADV_HUGEPAGE);
+#endif
+
+     x->a_next = ar->a_next; ar->a_next = x;
+     *base = x->a_base; *size = x->a_size;
+     return 1;
+}
+#else
+static int map_arena(int size, int flags) {
+     return 0;
+}
+
+int vm_more_arena(int kind, int n, code_addr *base, int *size) {
+     return 0;
+}
+#endif
+
+/* vm_arena -- choose the size and kind of the code arena */
+int vm_arena(int size, int flags) {
+     if (arena_state != 0)
+          vm_panic("vm_arena called too late");
+
+     arena_state = 1;
+     if (size == 0) return 0;
+     return map_arena(size, flags);
+}
+
+/* vm_get_arena -- find an arena, making them if nobody asked */
+int vm_get_arena(int kind, code_addr *base, int *size) {
+     if (arena_state == 0) {
+          arena_state = 1;
+          map_arena(ARENA, 0);
+     }
+
+     if (arena[kind].a_base == NULL) return 0;
+     *base = arena[kind].a_base; *size = arena[kind].a_size;
+     return 1;
+}
+
+/* vm_discard -- give back the storage for some free pages */
+void vm_discard(code_addr p, int size) {
+#ifdef HAVE_MEMFD_CREATE
+     for (int k = 0; k < 2; k++) {
+          for (struct arena *ar = &arena[k]; ar != NULL; ar = ar->a_next) {
+               if (p < ar->a_base || p >= ar->a_base + ar->a_size)
+                    continue;
+
+               /* Pages of a shared mapping are only freed by
+                  MADV_REMOVE.  With huge pages, only whole ones are
+                  given back. */
+               ptr a = ar->a_align;
+               ptr lo = ((ptr) p + a - 1) & ~(a-1);
+               ptr hi = ((ptr) p + size) & ~(a-1);
+               if (hi > lo) madvise((void *) lo, hi - lo, MADV_REMOVE);
+               return;
+          }
+     }
+#endif
+#ifdef MADV_DONTNEED
+     madvise(p, size, MADV_DONTNEED);
+#endif
+}
+
+/* A file of code shared with other processes is mapped with views
+   the same distances apart as those of the arenas, so that xaddr()
+   and raddr() work for it too: writable at the base address, read-only
+   at vm_doff and executable at vm_xoff from there.  The views must
+   not overlap. */
+
+#ifdef HAVE_MEMFD_CREATE
+/* vm_map_shared -- map a file at base, or anywhere if base is NULL,
+   and return its writable view, or NULL */
+code_addr vm_map_shared(int fd, int size, code_addr base) {
+     ptr off[3], span;
+     int prot[3], nviews = 0;
+
+     off[nviews] = 0; prot[nviews++] = PROT_READ|PROT_WRITE;
+     if (vm_doff != 0) {
+          if (size > vm_doff) return NULL;
+          off[nviews] = vm_doff; prot[nviews++] = PROT_READ;
+     }
+     if (vm_xoff != 0) {
+          if (size > vm_xoff - vm_doff) return NULL;
+          off[nviews] = vm_xoff; prot[nviews++] = PROT_READ|PROT_EXEC;
+     } else
+          prot[0] |= PROT_EXEC;
+     span = off[nviews-1] + size;
+
+     /* Reserve the whole span, then map the views over it */
+     int flags = MMAP_FLAGS;
+#ifdef MAP_FIXED_NOREPLACE
+     if (base != NULL) flags |= MAP_FIXED_NOREPLACE;
+#endif
+     void *r = mmap(base, span, PROT_NONE, flags, -1, 0);
+     if (r == MAP_FAILED) return NULL;
+     if (base != NULL && r != base) {
+          munmap(r, span);
+          return NULL;
+     }
+     code_addr a = (code_addr) r;
+
+#ifdef M64X32
+     if ((((unsigned long) a + span) & ~0x7fffffff) != 0) {
+          munmap(a, span);
+          return NULL;
+     }
+#endif
+
+     for (int i = 0; i < nviews; i++) {
+          if (mmap(a + off[i], size, prot[i], MAP_SHARED|MAP_FIXED,
+                   fd, 0) == MAP_FAILED) {
+               munmap(a, span);
+               return NULL;
+          }
+     }
+
+     return a;
+}
+#else
+code_addr vm_map_shared(int fd, int size, code_addr base) {
+     return NULL;
+}
+#endif
+
+/* A thread may go on running instructions that it fetched before
+   some code was patched.  If vm_patch_sync is set, vm_retarget waits
+   with membarrier until every thread of the process has passed a
+   point where its instruction stream is made consistent again.  The
+   command that promises this must be registered first, and if that
+   fails we fall back on one that only interrupts each thread. */
+
+int vm_patch_sync = 0;          /* Whether to wait after patching */
+
+#if HAVE_DECL_MEMBARRIER_CMD_PRIVATE_EXPEDITED
+#include <linux/membarrier.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int sync_cmd = -1;       /* Command to use, or 0 for none */
+
+/* membarrier -- call the system */
+static int membarrier(int cmd) {
+     return syscall(__NR_membarrier, cmd, 0, 0);
+}
+
+/* vm_sync_cores -- wait until no thread can run stale code */
+void vm_sync_cores(void) {
+     int cmd = __atomic_load_n(&sync_cmd, __ATOMIC_RELAXED);
+
+     if (cmd < 0) {
+          /* Registering twice does no harm.  Headers older than Linux
+             4.16 lack the SYNC_CORE commands, and they are members of
+             an enum, so configure looks for them. */
+#if HAVE_DECL_MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE
+          if (membarrier(MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_SYNC_CORE)
+              == 0)
+               cmd = MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE;
+          else
+#endif
+          if (membarrier(MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED) == 0)
+               cmd = MEMBARRIER_CMD_PRIVATE_EXPEDITED;
+          else
+               cmd = 0;
+          __atomic_store_n(&sync_cmd, cmd, __ATOMIC_RELAXED);
+     }
+
+     if (cmd != 0) membarrier(cmd);
+}
+#else
+void vm_sync_cores(void) {
+}
+#endif
@@ -0,0 +1,243 @@
+/*
+ * cache.c
+ * 
+ * This file is part of the Oxford Oberon-2 compiler
+ * Copyright (c) 2006--2016 J. M. Spivey
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include "config.h"
+#include "vm.h"
+#include "vminternal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#ifdef HAVE_MEMFD_CREATE
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#endif
+
+/* A code cache is a file that several processes map at the same
+   address, so that a procedure compiled by one of them can be called
+   by all.  The file begins with a header and an index of procedures,
+   keyed by byte strings that the client chooses; the rest holds the
+   code and data of a shared code space in each process.  Since the
+   code refers to other things by address, the processes must have the
+   same program and libraries at the same addresses, as they do if
+   they are forked from one parent.
+
+   Memory in the file is taken by advancing the top of the code or
+   data part atomically, and is never given back.  An entry in the
+   index is published by claiming an empty slot with compare-and-swap,
+   filling it in, and then marking it ready; lookups ignore slots that
+   are not ready, so they never wait.  If two processes publish the
+   same key, the first one to be ready wins.
+
+   Since other processes run the code in the file, it must belong to
+   the user and be writable by no-one else.  A file that was made but
+   not set up, because the process that made it died, is set up
+   again by the next process to open it. */
+
+#define MAGIC 0x7468756e        /* Marks a cache file */
+#define NSLOT 4096              /* Slots in the index, a power of two */
+#define DATAFRAC 4              /* Code size / data size */
+
+#define EMPTY 0                 /* States of a slot */
+#define BUSY 1
+#define READY 2
+
+struct slot {
+     unsigned sl_hash;          /* Hash of the key */
+     int sl_state;              /* EMPTY, BUSY or READY */
+     int sl_len;                /* Length of the key */
+     code_addr sl_key;          /* Key, kept in the data part */
+     void *sl_entry;            /* Entry address */
+};
+
+struct header {
+     unsigned h_magic;          /* MAGIC once set up */
+     int h_size;                /* Size of the file */
+     code_addr h_base;          /* Address of the writable view */
+     ptr h_xoff, h_doff;        /* Distances to the other views */
+     code_addr h_top[2], h_end[2]; /* Unused part of code and data */
+     struct slot h_slot[NSLOT]; /* The index */
+};
+
+#define HDRSIZE ((sizeof(struct header) + PAGESIZE-1) & ~(PAGESIZE-1))
+
+struct _vmcache {
+     struct header *c_hdr;      /* Header in the file */
+     vm_codespace c_space;      /* Code space for the file */
+};
+
+#ifdef HAVE_MEMFD_CREATE
+/* setup -- lay out a new file */
+static void setup(struct header *h, int size) {
+     code_addr base = (code_addr) h;
+     int data = ((size - HDRSIZE) / DATAFRAC) & ~(PAGESIZE-1);
+
+     h->h_size = size;
+     h->h_base = base;
+     h->h_xoff = vm_xoff; h->h_doff = vm_doff;
+     h->h_top[CODEMEM] = base + HDRSIZE;
+     h->h_end[CODEMEM] = h->h_top[DATAMEM] = base + size - data;
+     h->h_end[DATAMEM] = base + size;
+     __atomic_store_n(&h->h_magic, MAGIC, __ATOMIC_RELEASE);
+}
+
+/* vm_cache_open -- map a cache file, making it if it does not exist */
+vm_cache vm_cache_open(const char *path, int size) {
+     code_addr base = NULL, p;
+     struct header *h = NULL;
+     struct stat st;
+     int n;
+
+     /* Settle the arenas first, since the views go the same way */
+     vm_get_arena(CODEMEM, &p, &n);
+
+     int fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC|O_NOFOLLOW, 0600);
+     if (fd < 0) return NULL;
+
+     /* The lock makes sure that only one process sets up the file */
+     if (flock(fd, LOCK_EX) < 0 || fstat(fd, &st) < 0) goto done;
+     if (!S_ISREG(st.st_mode) || st.st_uid != geteuid()
+         || (st.st_mode & (S_IWGRP|S_IWOTH)) != 0) goto done;
+
+     struct header h0;
+     int k = offsetof(struct header, h_slot);
+     if (st.st_size < k || pread(fd, &h0, k, 0) != k
+         || h0.h_magic != MAGIC) {
+          /* New, or left half-made: start again from empty */
+          size = (size + PAGESIZE-1) & ~(PAGESIZE-1);
+          if (size < HDRSIZE + (DATAFRAC+1) * PAGESIZE
+              || ftruncate(fd, 0) < 0 || ftruncate(fd, size) < 0) goto done;
+     } else {
+          if (h0.h_xoff != vm_xoff || h0.h_doff != vm_doff) goto done;
+          size = h0.h_size; base = h0.h_base;
+     }
+
+     h = (struct header *) vm_map_shared(fd, size, base);
+     if (h != NULL && base == NULL) setup(h, size);
+
+done:
+     /* The mappings share the open file, so closing it would not
+        drop the lock */
+     flock(fd, LOCK_UN);
+     close(fd);
+     if (h == NULL) return NULL;
+
+     vm_cache c = (vm_cache) malloc(sizeof(struct _vmcache));
+     if (c == NULL) vm_panic("out of memory");
+     c->c_hdr = h;
+     c->c_space = vm_shared_codespace(h->h_top, h->h_end);
+     return c;
+}
+#else
+vm_cache vm_cache_open(const char *path, int size) {
+     return NULL;
+}
+#endif
+
+/* vm_cache_space -- the code space for a cache */
+vm_codespace vm_cache_space(vm_cache c) {
+     return c->c_space;
+}
+
+/* hashkey -- FNV-1a hash of a key */
+static unsigned hashkey(const unsigned char *key, int len) {
+     unsigned h = 2166136261u;
+     for (int i = 0; i < len; i++) {
+          h ^= key[i]; h *= 16777619u;
+     }
+     return h;
+}
+
+/* match -- test if a ready slot has a given key */
+static int match(struct slot *sl, unsigned hash, const void *key, int len) {
+     return (sl->sl_hash == hash && sl->sl_len == len
+             && memcmp(sl->sl_key, key, len) == 0);
+}
+
+/* vm_cache_find -- find the entry address for a key, or NULL */
+void *vm_cache_find(vm_cache c, const void *key, int len) {
+     struct header *h = c->c_hdr;
+     unsigned hash = hashkey(key, len);
+
+     for (int i = 0; i < NSLOT; i++) {
+          struct slot *sl = &h->h_slot[(hash + i) & (NSLOT-1)];
+          int state = __atomic_load_n(&sl->sl_state, __ATOMIC_ACQUIRE);
+          if (state == EMPTY) break;
+          if (state == READY && match(sl, hash, key, len))
+               return sl->sl_entry;
+     }
+
+     return NULL;
+}
+
+/* vm_cache_publish -- enter a procedure in the index, or return NULL
+   if there is no room */
+void *vm_cache_publish(vm_cache c, const void *key, int len, void *entry) {
+     struct header *h = c->c_hdr;
+     unsigned hash = hashkey(key, len);
+     code_addr x = (code_addr) entry;
+     void *e;
+
+     if (x < xaddr(h->h_base) || x >= xaddr(h->h_end[CODEMEM]))
+          vm_panic("vm_cache_publish: procedure is not in the cache");
+
+     e = vm_cache_find(c, key, len);
+     if (e != NULL) return e;
+
+     /* Keep a copy of the key in the file */
+     code_addr k = __atomic_fetch_add(&h->h_top[DATAMEM], (len + 7) & ~7,
+                                      __ATOMIC_RELAXED);
+     if (k + len > h->h_end[DATAMEM]) return NULL;
+     memcpy(k, key, len);
+
+     for (int i = 0; i < NSLOT; i++) {
+          struct slot *sl = &h->h_slot[(hash + i) & (NSLOT-1)];
+          int state = __atomic_load_n(&sl->sl_state, __ATOMIC_ACQUIRE);
+
+          if (state == EMPTY
+              && __atomic_compare_exchange_n(&sl->sl_state, &state, BUSY, 0,
+                                             __ATOMIC_ACQUIRE,
+                                             __ATOMIC_ACQUIRE)) {
+               sl->sl_hash = hash; sl->sl_len = len;
+               sl->sl_key = k; sl->sl_entry = entry;
+               __atomic_store_n(&sl->sl_state, READY, __ATOMIC_RELEASE);
+               return entry;
+          }
+
+          if (state == READY && match(sl, hash, key, len))
+               return sl->sl_entry;
+     }
+
+     /* The index is full */
+     return NULL;
+}
@@ -35,20 +35,45 @@
 #include <stdio.h>
 #include <string.h>
 
-#ifdef LINUX
-#define USE_MPROTECT 1
-#endif
-
-#ifdef MACOS
-#define USE_MPROTECT 1
-#endif
-
 #define MARGIN 32	        /* Safety margin for swiching buffers */
 #define MIN 128                 /* Min space at beginning of routine */
+#define MINBUF (vm_codepage/4)  /* Min size of a fresh buffer */
+
+int vm_codepage = CODEPAGE;     /* Size of block allocated for code */
+int vm_contiguous = 0;          /* Whether to move rather than chain */
+int vm_peephole = 1;            /* Whether the back end may improve code */
+int vm_relax = 1;               /* Whether to shorten jumps afterwards */
+
+THREAD code_addr pc;            /* Current assembly location */
+static THREAD const char *proc_name;
+static THREAD code_addr proc_beg, proc_entry, limit;
+static THREAD int inproc;       /* Whether compiling a procedure */
+static THREAD int chained;      /* Whether it continues in another buffer */
+static THREAD int entry_jump;   /* Size of jump left at entry by move */
 
-code_addr pc;                   /* Current assembly location */
-static const char *proc_name;
-static code_addr proc_beg, codebuf, limit;
+/* The code buffer is an extent [bufbeg, bufend) of code memory; code
+   grows upwards from bufbeg and literals that must be within reach of
+   pc-relative loads grow downwards from bufend. */
+static THREAD extent buf;
+static THREAD code_addr bufbeg, bufend;
+
+/* Other literals and jump tables go in a separate data buffer, and
+   trampolines in a buffer of their own, so that neither shares cache
+   lines with the code.  Each is filled upwards. */
+struct buffer {
+     int b_kind;                /* CODEMEM or DATAMEM */
+     extent b_ext;              /* Extent, or NULL */
+     code_addr b_beg, b_ptr, b_end; /* Unclaimed, next free, end */
+};
+
+static THREAD struct buffer databuf = { DATAMEM }, stubbuf = { CODEMEM };
+
+/* Stubs for jobs and the slots they jump through outlive any
+   procedure, so they come from buffers whose extents are never given
+   to an owner */
+static THREAD struct buffer jobbuf = { CODEMEM }, jobdata = { DATAMEM };
+
+#define owned(b) ((b) != &jobbuf && (b) != &jobdata)
 
 /* byte -- contribute a byte to the object code */
 void byte(int x) {
@@ -73,112 +98,337 @@ void qword(uint64 x) {
      pc += 8;
 }
 
-/* vm_literal_align -- allocate aligned space in code buffer */
-void *vm_literal_align(int n, int a) {
-     vm_space(n+a);
-     limit = (code_addr) (((ptr) limit - n) & ~(a-1));
-     return limit;
-}
+#define align(p, a) ((code_addr) (((ptr) (p) + (a)-1) & ~(ptr) ((a)-1)))
 
-#ifdef FREEBSD
-#define USE_MPROTECT 1
-#endif
+/* claimbuf -- give the used part of a buffer to the current procedure */
+static void claimbuf(struct buffer *b) {
+     if (b->b_ext == NULL || b->b_ptr == b->b_beg) return;
+
+     if (b->b_ptr == b->b_end) {
+          if (owned(b)) vm_own(b->b_ext);
+          if (b->b_kind == CODEMEM) vm_pin(b->b_ext);
+          b->b_ext = NULL;
+          return;
+     }
 
-#ifdef USE_MPROTECT
-#include <sys/mman.h>
+     extent x = b->b_ext;
+     b->b_ext = vm_split(x, b->b_ptr);
+     if (owned(b)) vm_own(x);
+     if (b->b_kind == CODEMEM) vm_pin(x);
+     b->b_beg = b->b_ptr;
+}
+
+/* bump -- allocate aligned space from a buffer */
+static code_addr bump(struct buffer *b, int n, int a) {
+     code_addr p = align(b->b_ptr, a);
 
-static void mprot(void *p, int flags) {
-     if (mprotect(p, CODEPAGE, flags) < 0) {
-          perror("mprotect failed");
-          exit(2);
+     if (b->b_ext == NULL || p + n > b->b_end) {
+          code_addr q, r;
+          extent x = vm_getext(b->b_kind, n+a, &q, &r);
+          claimbuf(b);
+          if (b->b_ext != NULL) vm_freeext(b->b_ext);
+          b->b_ext = x; b->b_beg = q; b->b_end = r;
+          p = align(q, a);
      }
+
+     b->b_ptr = p + n;
+     return p;
 }
 
-#define prot_write(p)    mprot(p, PROT_READ|PROT_WRITE)
-#define prot_exec(p)     mprot(p, PROT_READ|PROT_EXEC)
-#define prot_writexec(p) mprot(p, PROT_READ|PROT_WRITE|PROT_EXEC)
-#endif
+/* vm_literal_align -- allocate aligned space in data buffer */
+void *vm_literal_align(int n, int a) {
+     vm_count.literal_bytes += n;
+     return bump(&databuf, n, a);
+}
 
-#ifdef WINDOWS
-#undef byte
-#include <windows.h>
+/* vm_stub -- allocate space for a trampoline */
+code_addr vm_stub(int n) {
+     vm_count.stub_bytes += n;
+     return bump(&stubbuf, n, 16);
+}
 
-static void vprot(void *p, long unsigned flags) {
-     long unsigned oldflags;
+/* vm_jobstub -- allocate space for a stub that no procedure owns */
+code_addr vm_jobstub(int n) {
+     return bump(&jobbuf, n, 16);
+}
 
-     if (VirtualProtect(p, CODEPAGE, flags, &oldflags) == 0)
-          vm_panic("VirtualProtect failed");
+/* vm_jobslot -- allocate a data word for a stub to jump through */
+code_addr vm_jobslot(void) {
+     return bump(&jobdata, sizeof(ptr), sizeof(ptr));
 }
 
-#define prot_write(p)    vprot(p, PAGE_READWRITE)
-#define prot_exec(p)     vprot(p, PAGE_EXECUTE_READ)
-#define prot_writexec(p) vprot(p, PAGE_EXECUTE_READWRITE)
-#endif
+/* vm_codelit -- allocate space for a literal in the code buffer, or
+   return NULL if it would be more than reach bytes beyond pc */
+code_addr vm_codelit(int n, int reach) {
+     vm_space(n+4);
+     code_addr p = (code_addr) (((ptr) limit - n) & ~3);
+     if (p - pc > reach) return NULL;
+     vm_count.literal_bytes += n;
+     limit = p;
+     return limit;
+}
 
 #ifdef USE_FLUSH
-#define FRAGS 16
-static code_addr fragbeg[FRAGS], fragend[FRAGS];
-static int nfrags;
+/* Ranges of code written since the last commit, with adjacent ranges
+   merged */
+static THREAD code_addr *fragbeg, *fragend;
+static THREAD int nfrags, maxfrags;
+static THREAD code_addr fragstart; /* Start of the current range */
+
+/* touch -- note a range of code that must be flushed */
+static void touch(code_addr beg, code_addr end) {
+     if (end <= beg) return;
+
+     if (nfrags > 0 && fragend[nfrags-1] == beg) {
+          fragend[nfrags-1] = end;
+          return;
+     }
+
+     if (nfrags >= maxfrags) {
+          maxfrags = (maxfrags == 0 ? 16 : 2*maxfrags);
+          fragbeg = (code_addr *) realloc(fragbeg, maxfrags * sizeof(code_addr));
+          fragend = (code_addr *) realloc(fragend, maxfrags * sizeof(code_addr));
+          if (fragbeg == NULL || fragend == NULL) vm_panic("out of memory");
+     }
+
+     fragbeg[nfrags] = beg; fragend[nfrags] = end;
+     nfrags++;
+}
 
 /* vm_flush -- clear code from data cache */
 static void vm_flush(void) {
      // This is probably ARM-specific
      for (int i = 0; i < nfrags; i++)
-	  __clear_cache(fragbeg[i], fragend[i]);
+	  __clear_cache(xaddr(fragbeg[i]), xaddr(fragend[i]));
+     nfrags = 0;
 }
 #endif
 
+static THREAD int batch = 0;    /* Depth of nested batches */
+
+/* commit -- make code written since the last commit ready to run */
+static void commit(void) {
+     vm_protect();
+#ifdef USE_FLUSH
+     vm_flush();
+#endif
+}
+
+/* vm_batch_begin -- start a batch of procedures */
+void vm_batch_begin(void) {
+     batch++;
+}
+
+/* vm_batch_commit -- make a batch of procedures ready to run */
+void vm_batch_commit(void) {
+     if (batch == 0) vm_panic("vm_batch_commit without vm_batch_begin");
+     if (--batch == 0) commit();
+}
+
+/* claim -- give the used parts of the buffer to the current procedure */
+static void claim(void) {
+     if (limit < bufend) {
+          /* Code that refers to literals here cannot be moved away */
+          if (inproc) vm_pinproc();
+
+          if (limit == bufbeg) {
+               vm_own(buf); buf = NULL;
+               return;
+          }
+          vm_own(vm_split(buf, limit));
+          bufend = limit;
+     }
+
+     if (pc > bufbeg) {
+          if (pc == bufend) {
+               vm_own(buf); buf = NULL;
+               return;
+          }
+          extent x = buf;
+          buf = vm_split(x, pc);
+          vm_own(x);
+          bufbeg = pc;
+     }
+}
+
+/* dropbuf -- give back the unused part of a buffer */
+static void dropbuf(struct buffer *b) {
+     claimbuf(b);
+     if (b->b_ext != NULL) {
+          vm_freeext(b->b_ext);
+          b->b_ext = NULL;
+     }
+}
+
+/* vm_dropbufs -- give back the unused parts of all buffers */
+void vm_dropbufs(void) {
+     if (buf != NULL) claim();
+     if (buf != NULL) {
+          vm_freeext(buf);
+          buf = NULL;
+     }
+     dropbuf(&databuf); dropbuf(&stubbuf); dropbuf(&jobbuf);
+     dropbuf(&jobdata);
+}
+
+/* vm_end_thread -- give back memory held by this thread */
+void vm_end_thread(void) {
+     if (inproc) vm_panic("vm_end_thread called while compiling");
+     vm_dropbufs();
+     vm_dropslabs();
+     vm_free_scratch();
+     vm_free_ir();
+}
+
 /* vm_begin -- begin new procedure */
 void *vm_begin_locals(const char *name, int n, int locs) {
      proc_name = name;
+     /* Literals made since the last procedure are kept for ever */
+     if (buf != NULL) claim();
+     claimbuf(&databuf); claimbuf(&stubbuf);
+     vm_startproc();
      vm_space(MIN);
+     inproc = 1; chained = 0; entry_jump = 0;
      proc_beg = pc;
 #ifdef USE_FLUSH
-     nfrags = 0; fragbeg[0] = pc;
+     fragstart = pc;
+#endif
+     if (vm_ir_begin(n, locs))
+          proc_entry = xaddr(pc);
+     else
+          proc_entry = xaddr(vm_prelude(n, locs));
+     return proc_entry;
+}
+
+/* move -- copy the procedure so far to a bigger buffer */
+static void move(int space) {
+     /* Literals for pc-relative loads at the top of the buffer would
+        not stay in reach, so the back end puts them in line first;
+        that may leave enough room without moving */
+     if (limit < bufend) {
+          if (!vm_dumplits(limit, bufend))
+               vm_fail("cannot move procedure %s with literals", proc_name);
+          limit = bufend;
+          if (pc + space <= limit - MARGIN) return;
+     }
+
+     int used = pc - proc_beg;
+     int size = 2*used + space + 2*MARGIN;
+     code_addr old = proc_beg, p, q;
+
+     if (size < vm_codepage) size = vm_codepage;
+     extent x = vm_getext(CODEMEM, size+8, &p, &q);
+
+     /* Keep the same alignment, so patchable sites stay aligned */
+     p += (old - p) & 7;
+     memcpy(p, old, used);
+     vm_relocate(old, pc, p - old);
+     vm_move(p - old);
+
+     /* The client already has the entry address, so leave a jump there.
+        If we move again, this jump will be relocated too.  It counts as
+        a chain and as part of the size of the procedure. */
+     pc = old;
+     if (xaddr(old) == proc_entry) {
+          vm_chain(proc_entry + (p - old));
+          vm_count.chains++;
+          entry_jump = pc - old;
+     }
+#ifdef USE_FLUSH
+     touch(old, pc);
+#endif
+     claim();
+     if (buf != NULL) vm_freeext(buf);
+
+     buf = x; bufbeg = p; bufend = limit = q;
+     proc_beg = p; pc = p + used;
+#ifdef USE_FLUSH
+     fragstart = p;
 #endif
-     return vm_prelude(n, locs);
 }
 
 /* vm_space -- ensure space in code buffer */
 void vm_space(int space) {
-     if (codebuf == NULL || pc + space > limit - MARGIN) {
-	  code_addr p = (code_addr) vm_alloc(CODEPAGE);
-	  if (codebuf != NULL) vm_chain(p);
-          prot_writexec(p);
-#if USE_FLUSH
-	  fragend[nfrags++] = pc;
-	  if (nfrags >= FRAGS) vm_panic("too many frags");
-	  fragbeg[nfrags] = p;
+     if (inproc && vm_contiguous && pc + space > limit - MARGIN) {
+          move(space);
+          return;
+     }
+
+     if (buf == NULL || pc + space > limit - MARGIN) {
+          int size = space + 2*MARGIN;
+	  code_addr p, q;
+          if (size < MINBUF) size = MINBUF;
+          extent x = vm_getext(CODEMEM, size, &p, &q);
+	  if (buf != NULL) {
+               if (inproc) {
+                    vm_chain(xaddr(p));
+                    vm_count.chains++;
+                    chained = 1;
+               }
+               claim();
+               if (buf != NULL) vm_freeext(buf);
+          }
+#ifdef USE_FLUSH
+          if (inproc) {
+               touch(fragstart, pc);
+               fragstart = p;
+          }
 #endif
-	  codebuf = p; limit = p + CODEPAGE;
-	  pc = codebuf;
+	  buf = x; bufbeg = p; bufend = limit = q;
+	  pc = p;
      }
 }
 
 /* vm_end -- finish a procedure */
 void vm_end(void) {
+     vm_ir_end();
      vm_postlude();
+     if (vm_relax && !chained) pc = vm_shorten(proc_beg, pc, proc_entry);
      vm_reset();
 
      if (vm_debug >= 5) {
-	  // This is broken if we switched pages in mid-stream.
+	  // This is broken if we switched pages in mid-stream, unless
+	  // vm_contiguous is set.
           char buf[128];
           strcpy(buf, proc_name);
           strcat(buf, ".vmdump");
           FILE *fp = fopen(buf, "wb");
           printf("Dumping\n");
-          if (fp == NULL) return;
-          fwrite(proc_beg, 1, pc-proc_beg, fp);
-          fclose(fp);
+          if (fp != NULL) {
+               fwrite(proc_beg, 1, pc-proc_beg, fp);
+               fclose(fp);
+          }
      }
+
+     claim();
+     claimbuf(&databuf); claimbuf(&stubbuf);
+     vm_finishproc(proc_entry, proc_name);
+     inproc = 0;
 #ifdef USE_FLUSH
-     fragend[nfrags++] = pc;
-     vm_flush();
+     touch(fragstart, pc);
 #endif
+     if (batch == 0) commit();
+}
+
+/* vm_abandon -- give up the procedure being compiled after an error */
+void vm_abandon(void) {
+     vm_ir_drop();
+     vm_reset();
+     vm_dropproc();
+
+     /* Whatever is unclaimed in the buffers belongs to the procedure */
+     if (inproc) {
+          if (buf != NULL) {
+               pc = bufbeg; limit = bufend;
+          }
+          databuf.b_ptr = databuf.b_beg;
+          stubbuf.b_ptr = stubbuf.b_beg;
+          inproc = 0;
+     }
 }
 
 int vm_procsize(void) {
-     return pc - proc_beg;
+     return pc - proc_beg + entry_jump;
 }
 
 int vm_addr(void *p) {
@@ -0,0 +1,1503 @@
+/*
+ * codemem.c
+ * 
+ * This file is part of the Oxford Oberon-2 compiler
+ * Copyright (c) 2006--2016 J. M. Spivey
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "vm.h"
+#include "vminternal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/* Memory for code is either the arena set up in arena.c, or else is
+   obtained from vm_alloc() in chunks; either way, it is divided into
+   extents.  The extents of each chunk are kept on a list in address
+   order, so that an extent that is freed can be merged with free
+   neighbours, and free extents are also kept on lists according to
+   their size.  Each procedure owns the extents that hold its code and
+   literals, and vm_free_proc() gives them all back together.  Whole
+   pages that become free are returned to the operating system, and
+   so is a chunk from vm_alloc() that becomes entirely free.  The
+   bookkeeping is kept out of line, so that maintaining it needs no
+   writes to code pages. */
+
+#ifdef LINUX
+#define USE_MPROTECT 1
+#endif
+
+#ifdef MACOS
+#define USE_MPROTECT 1
+#endif
+
+#ifdef FREEBSD
+#define USE_MPROTECT 1
+#endif
+
+#ifdef USE_MPROTECT
+#include <sys/mman.h>
+
+static void mprot(void *p, int size, int flags) {
+     if (mprotect(p, size, flags) < 0) {
+          perror("mprotect failed");
+          exit(2);
+     }
+}
+
+#define prot_writexec(p, n) mprot(p, n, PROT_READ|PROT_WRITE|PROT_EXEC)
+#endif
+
+#ifdef WINDOWS
+#undef byte
+#include <windows.h>
+
+static void vprot(void *p, int size, long unsigned flags) {
+     long unsigned oldflags;
+
+     if (VirtualProtect(p, size, flags, &oldflags) == 0)
+          vm_panic("VirtualProtect failed");
+}
+
+#define prot_writexec(p, n) vprot(p, n, PAGE_EXECUTE_READWRITE)
+#endif
+
+/* The allocator is shared by all threads, and is protected by a lock.
+   Each public entry point takes the lock, and the static routines
+   assume that it is held. */
+
+static int waits;               /* Times the lock was found busy */
+
+#ifdef HAVE_LIBPTHREAD
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* getlock -- take the lock, counting the times we must wait */
+static void getlock(void) {
+     if (pthread_mutex_trylock(&lock) == 0) return;
+     __atomic_add_fetch(&waits, 1, __ATOMIC_RELAXED);
+     pthread_mutex_lock(&lock);
+}
+
+#define LOCK() getlock()
+#define UNLOCK() pthread_mutex_unlock(&lock)
+#else
+#define LOCK()
+#define UNLOCK()
+#endif
+
+typedef struct _slab *slab;
+
+struct _extent {
+     code_addr x_base;          /* Start address */
+     int x_size;                /* Size in bytes */
+     int x_free;                /* Whether on a free list */
+     int x_kind;                /* CODEMEM or DATAMEM */
+     vm_codespace x_space;      /* Code space that owns the extent */
+     int x_pinned;              /* Whether the extent must not move */
+     extent x_prev, x_next;     /* Neighbours in the same chunk */
+     extent x_link;             /* Next on free list or in procedure */
+     extent x_back;             /* Previous on free list */
+     slab x_slab;               /* Slab containing the extent, or NULL */
+};
+
+#define NCLASS 32
+#define HSIZE 1024
+
+typedef struct _proc *proc;
+typedef struct _block *block;
+
+/* Each code space has two heaps: one for code, and one for data such
+   as literals and jump tables that is kept apart from the code. */
+struct heap {
+     extent freelist[NCLASS];   /* Free extents of size [2^i, 2^(i+1)) */
+     int ready;                 /* Whether the arena has been sought */
+     int arena;                 /* Whether memory is from an arena */
+     int reserved;              /* Bytes of arena or chunks */
+     int nfree;                 /* Bytes on the free lists */
+     int peak;                  /* Most bytes ever in use */
+     int slack;                 /* Bytes of slabs not in a live piece */
+     code_addr top, end;        /* Part of the arena never used */
+     code_addr *front;          /* Where top is kept, maybe in a file */
+     extent last;               /* Last extent taken from [.., top) */
+};
+
+/* Code spaces other than the first take memory in blocks from the
+   heaps of the first, and give a block back when it is entirely free
+   or when the space is destroyed, so that a space can be torn down
+   without visiting its procedures one by one. */
+struct _block {
+     extent b_parent;           /* The block as an extent of the first space */
+     extent b_first;            /* Lowest extent of the block in this space */
+     block b_next;              /* Next block of the same space */
+};
+
+#define BLOCK (8*vm_codepage)   /* Size of block to borrow */
+
+struct _codespace {
+     struct heap s_heap[2];     /* Heaps for code and data */
+     block s_blocks;            /* Blocks borrowed from the first space */
+     proc s_procs[HSIZE];       /* Procedures hashed by entry address */
+     int s_shared;              /* Whether shared with other processes */
+     vm_codespace s_next;       /* Next space */
+};
+
+static struct _codespace space0; /* The first space */
+static THREAD vm_codespace space = &space0; /* Space for new procedures */
+
+#define heapof(x) (&(x)->x_space->s_heap[(x)->x_kind])
+#define freelist(x) heapof(x)->freelist
+
+/* unused -- size of the part of the arena never used */
+static int unused(struct heap *h) {
+     if (!h->arena) return 0;
+     code_addr top = __atomic_load_n(h->front, __ATOMIC_RELAXED);
+     return (top < h->end ? h->end - top : 0);
+}
+
+/* idle -- bytes of slabs that are neither carved nor in use */
+static int idle(struct heap *h) {
+     return __atomic_load_n(&h->slack, __ATOMIC_RELAXED);
+}
+
+/* sizeclass -- index of free list for extents of a given size */
+static int sizeclass(int size) {
+     int c = 0;
+     while (size > 1) { size >>= 1; c++; }
+     return c;
+}
+
+/* newext -- allocate a record for an extent */
+static extent newext(vm_codespace s, int kind, code_addr base, int size) {
+     extent x = (extent) malloc(sizeof(struct _extent));
+     if (x == NULL) vm_panic("out of memory");
+     x->x_base = base; x->x_size = size; x->x_free = 0;
+     x->x_kind = kind; x->x_space = s; x->x_pinned = 0;
+     x->x_prev = x->x_next = NULL;
+     x->x_link = x->x_back = NULL;
+     x->x_slab = NULL;
+     return x;
+}
+
+/* link_free -- add an extent to the right free list */
+static void link_free(extent x) {
+     int c = sizeclass(x->x_size);
+     x->x_free = 1;
+     heapof(x)->nfree += x->x_size;
+     x->x_back = NULL;
+     x->x_link = freelist(x)[c];
+     if (x->x_link != NULL) x->x_link->x_back = x;
+     freelist(x)[c] = x;
+}
+
+/* unlink_free -- remove an extent from its free list */
+static void unlink_free(extent x) {
+     if (x->x_back != NULL)
+          x->x_back->x_link = x->x_link;
+     else
+          freelist(x)[sizeclass(x->x_size)] = x->x_link;
+     if (x->x_link != NULL) x->x_link->x_back = x->x_back;
+     heapof(x)->nfree -= x->x_size;
+     x->x_free = 0;
+     x->x_link = x->x_back = NULL;
+}
+
+/* merge -- absorb the following extent x->x_next into x */
+static void merge(extent x) {
+     extent y = x->x_next;
+     if (heapof(x)->last == y) heapof(x)->last = x;
+     x->x_size += y->x_size;
+     x->x_next = y->x_next;
+     if (y->x_next != NULL) y->x_next->x_prev = x;
+     free(y);
+}
+
+/* release -- give back whole pages of x that overlap [lo, hi) */
+static void release(extent x, code_addr lo, code_addr hi) {
+     ptr a = ((ptr) lo) & ~(PAGESIZE-1);
+     ptr b = ((ptr) hi + PAGESIZE-1) & ~(PAGESIZE-1);
+     ptr xa = ((ptr) x->x_base + PAGESIZE-1) & ~(PAGESIZE-1);
+     ptr xb = ((ptr) x->x_base + x->x_size) & ~(PAGESIZE-1);
+     if (a < xa) a = xa;
+     if (b > xb) b = xb;
+     if (b > a) vm_discard((code_addr) a, b - a);
+}
+
+/* Chunks from vm_alloc() are writable at first, and are made
+   executable at the next commit; neighbouring chunks are changed
+   together. */
+
+static code_addr *newbeg;       /* Chunks waiting to be made executable */
+static int *newsize;
+static int nnew, maxnew;
+
+/* pend -- note a new chunk */
+static void pend(code_addr p, int n) {
+     if (nnew >= maxnew) {
+          maxnew = (maxnew == 0 ? 16 : 2*maxnew);
+          newbeg = (code_addr *) realloc(newbeg, maxnew * sizeof(code_addr));
+          newsize = (int *) realloc(newsize, maxnew * sizeof(int));
+          if (newbeg == NULL || newsize == NULL) vm_panic("out of memory");
+     }
+
+     newbeg[nnew] = p; newsize[nnew] = n;
+     __atomic_store_n(&nnew, nnew+1, __ATOMIC_RELAXED);
+}
+
+/* unpend -- forget a chunk that is given back before the commit */
+static void unpend(code_addr p) {
+     for (int i = 0; i < nnew; i++) {
+          if (newbeg[i] == p) {
+               __atomic_store_n(&nnew, nnew-1, __ATOMIC_RELAXED);
+               for (int j = i; j < nnew; j++) {
+                    newbeg[j] = newbeg[j+1]; newsize[j] = newsize[j+1];
+               }
+               return;
+          }
+     }
+}
+
+/* protect -- make new chunks executable */
+static void protect(void) {
+     int i = 0;
+
+     while (i < nnew) {
+          code_addr p = newbeg[i];
+          int n = newsize[i++];
+#ifdef USE_MPROTECT
+          while (i < nnew && newbeg[i] == p + n) n += newsize[i++];
+#endif
+          prot_writexec(p, n);
+     }
+
+     __atomic_store_n(&nnew, 0, __ATOMIC_RELAXED);
+}
+
+/* vm_protect -- make new chunks executable.  A thread sees its own
+   chunks in nnew without taking the lock. */
+void vm_protect(void) {
+     if (__atomic_load_n(&nnew, __ATOMIC_RELAXED) == 0) return;
+     LOCK();
+     protect();
+     UNLOCK();
+}
+
+static extent getext(vm_codespace s, int kind, int size,
+                     code_addr *base, code_addr *end);
+static extent split(extent x, code_addr p);
+static void freeext(extent x);
+
+/* borrow -- take a block for a space from the first space */
+static extent borrow(vm_codespace s, int kind, int size) {
+     code_addr p, q;
+     extent y = getext(&space0, kind, (size < BLOCK ? BLOCK : size), &p, &q);
+     if (y == NULL) return NULL;
+
+     block b = (block) malloc(sizeof(struct _block));
+     if (b == NULL) vm_panic("out of memory");
+     b->b_parent = y;
+     b->b_first = newext(s, kind, p, q - p);
+     b->b_next = s->s_blocks;
+     s->s_blocks = b;
+     s->s_heap[kind].reserved += q - p;
+     return b->b_first;
+}
+
+/* giveback -- return a free block to the first space */
+static void giveback(extent x) {
+     vm_codespace s = x->x_space;
+     block *bb = &s->s_blocks, b;
+
+     while ((b = *bb)->b_first != x) bb = &b->b_next;
+     *bb = b->b_next;
+
+     s->s_heap[x->x_kind].reserved -= x->x_size;
+     freeext(b->b_parent);
+     free(b); free(x);
+}
+
+/* frontier -- take n bytes from the part of the arena never used.
+   Other processes may take memory from a shared space at the same
+   time, so top is advanced by compare-and-swap, and left alone if
+   there is not room.  In other spaces, each extent is linked to the
+   one before, so that the arena is a single chunk in which free
+   neighbours can merge. */
+static extent frontier(vm_codespace s, int kind, int n) {
+     struct heap *h = &s->s_heap[kind];
+     code_addr p = __atomic_load_n(h->front, __ATOMIC_RELAXED);
+
+     do {
+          if (p + n > h->end) return NULL;
+     } while (!__atomic_compare_exchange_n(h->front, &p, p + n, 0,
+                                           __ATOMIC_RELAXED,
+                                           __ATOMIC_RELAXED));
+
+     extent x = newext(s, kind, p, n);
+     if (!s->s_shared) {
+          x->x_prev = h->last;
+          if (h->last != NULL) h->last->x_next = x;
+          h->last = x;
+     }
+     return x;
+}
+
+/* more -- add an arena to the first space when its arena is full,
+   putting what is left of the old one on the free lists */
+static int more(int kind, int n) {
+     struct heap *h = &space0.s_heap[kind];
+     code_addr p;
+     int size;
+
+     if (!vm_more_arena(kind, n, &p, &size)) return 0;
+     if (h->top < h->end) freeext(frontier(&space0, kind, h->end - h->top));
+     h->reserved += size;
+     h->top = p; h->end = p + size;
+     h->last = NULL;
+     return 1;
+}
+
+/* getext -- allocate an extent, or return NULL if there is no room */
+static extent getext(vm_codespace s, int kind, int size,
+                     code_addr *base, code_addr *end) {
+     struct heap *h = &s->s_heap[kind];
+     extent x = NULL;
+     int n;
+
+     if (s == &space0 && !h->ready) {
+          code_addr p;
+          if (vm_get_arena(kind, &p, &n)) {
+               h->arena = 1;
+               h->reserved = n;
+               h->top = p; h->end = p + n;
+               h->front = &h->top;
+          }
+          __atomic_store_n(&h->ready, 1, __ATOMIC_RELEASE);
+     }
+
+     /* First fit in the smallest class that might do, then any larger
+        extent at all */
+     for (int c = sizeclass(size); c < NCLASS && x == NULL; c++) {
+          for (extent y = h->freelist[c]; y != NULL; y = y->x_link) {
+               if (y->x_size >= size) { x = y; break; }
+          }
+     }
+
+     n = (size < vm_codepage ? vm_codepage : (size + 63) & ~63);
+
+     if (x != NULL)
+          unlink_free(x);
+     else if (h->arena) {
+          x = frontier(s, kind, n);
+          if (x == NULL && s == &space0 && more(kind, n))
+               x = frontier(s, kind, n);
+          if (x == NULL) return NULL;
+     }
+     else if (s != &space0) {
+          x = borrow(s, kind, n);
+          if (x == NULL) return NULL;
+     } else {
+          int m = (n + PAGESIZE - 1) & ~(PAGESIZE-1);
+          code_addr p = (code_addr) vm_alloc(m);
+          if (p == NULL) return NULL;
+          if (kind == CODEMEM) pend(p, m);
+          h->reserved += m;
+          x = newext(s, kind, p, m);
+     }
+
+     /* Put back any surplus from a big extent */
+     if (x->x_size >= n + vm_codepage)
+          link_free(split(x, x->x_base + n));
+
+     int used = h->reserved - h->nfree - unused(h);
+     if (used > h->peak) h->peak = used;
+
+     *base = x->x_base; *end = x->x_base + x->x_size;
+     return x;
+}
+
+/* Each thread carves the extents it needs for the first space from
+   slabs of its own with a bump pointer, so that compiling small
+   procedures needs no locks.  The pieces of a slab are never merged:
+   the slab goes back to the heap when the thread has finished with it
+   and every piece has been freed, and then merges with any free
+   neighbours. */
+
+#define SLAB (16*vm_codepage)   /* Size of a slab */
+
+struct _slab {
+     extent t_ext;              /* The slab as an extent of the heap */
+     code_addr t_ptr, t_end;    /* Part not yet carved */
+     int t_live;                /* Pieces not freed, plus one if in use */
+};
+
+static THREAD slab myslab[2];   /* Slabs in use by this thread */
+
+/* newslab -- get a slab for this thread */
+static slab newslab(int kind) {
+     code_addr p, q;
+
+     LOCK();
+     extent x = getext(&space0, kind, SLAB, &p, &q);
+     UNLOCK();
+     if (x == NULL) return NULL;
+     __atomic_add_fetch(&heapof(x)->slack, x->x_size, __ATOMIC_RELAXED);
+
+     slab t = (slab) malloc(sizeof(struct _slab));
+     if (t == NULL) vm_panic("out of memory");
+     t->t_ext = x;
+     t->t_ptr = x->x_base; t->t_end = x->x_base + x->x_size;
+     t->t_live = 1;
+     return t;
+}
+
+/* unslab -- drop a reference to a slab, and return it if it is free */
+static slab unslab(slab t) {
+     if (__atomic_sub_fetch(&t->t_live, 1, __ATOMIC_ACQ_REL) > 0)
+          return NULL;
+     return t;
+}
+
+/* retire -- give back a free slab */
+static void retire(slab t) {
+     __atomic_sub_fetch(&heapof(t->t_ext)->slack, t->t_ext->x_size,
+                        __ATOMIC_RELAXED);
+     freeext(t->t_ext);
+     free(t);
+}
+
+/* piece -- make an extent for part of a slab */
+static extent piece(slab t, int kind, code_addr p, int size) {
+     extent x = newext(&space0, kind, p, size);
+     x->x_slab = t;
+     __atomic_add_fetch(&t->t_live, 1, __ATOMIC_RELAXED);
+     return x;
+}
+
+/* unpiece -- free a piece of a slab, and return the slab if it is free */
+static slab unpiece(extent x) {
+     __atomic_add_fetch(&heapof(x)->slack, x->x_size, __ATOMIC_RELAXED);
+     slab t = unslab(x->x_slab);
+     free(x);
+     return t;
+}
+
+/* carve -- allocate an extent from this thread's slab */
+static extent carve(int kind, int size, code_addr *base, code_addr *end) {
+     slab t = myslab[kind];
+     int n = (size < vm_codepage ? vm_codepage : (size + 63) & ~63);
+
+     if (t == NULL || t->t_ptr + n > t->t_end) {
+          if (t != NULL && (t = unslab(t)) != NULL) {
+               LOCK();
+               retire(t);
+               UNLOCK();
+          }
+          myslab[kind] = t = newslab(kind);
+          if (t == NULL) return NULL;
+     }
+
+     extent x = piece(t, kind, t->t_ptr, n);
+     __atomic_sub_fetch(&heapof(x)->slack, n, __ATOMIC_RELAXED);
+     t->t_ptr += n;
+     *base = x->x_base; *end = x->x_base + x->x_size;
+     return x;
+}
+
+/* vm_dropslabs -- give up this thread's slabs */
+void vm_dropslabs(void) {
+     for (int k = 0; k < 2; k++) {
+          slab t = myslab[k];
+          if (t == NULL) continue;
+          myslab[k] = NULL;
+          if ((t = unslab(t)) != NULL) {
+               LOCK();
+               retire(t);
+               UNLOCK();
+          }
+     }
+}
+
+/* vm_getext -- allocate an extent of code or data memory */
+extent vm_getext(int kind, int size, code_addr *base, code_addr *end) {
+     if (space == &space0 && size <= SLAB/4) {
+          extent x = carve(kind, size, base, end);
+          if (x != NULL) return x;
+     }
+
+     LOCK();
+     extent x = getext(space, kind, size, base, end);
+     UNLOCK();
+     if (x == NULL)
+          vm_fail("out of %s memory", (kind == CODEMEM ? "code" : "data"));
+     return x;
+}
+
+/* split -- divide an extent at p and return the upper part */
+static extent split(extent x, code_addr p) {
+     extent y = newext(x->x_space, x->x_kind, p, x->x_base + x->x_size - p);
+     assert(p > x->x_base && p < x->x_base + x->x_size);
+     x->x_size = p - x->x_base;
+     if (heapof(x)->last == x) heapof(x)->last = y;
+     y->x_prev = x; y->x_next = x->x_next;
+     if (x->x_next != NULL) x->x_next->x_prev = y;
+     x->x_next = y;
+     return y;
+}
+
+/* vm_split -- divide an extent at p and return the upper part */
+extent vm_split(extent x, code_addr p) {
+     if (x->x_slab != NULL) {
+          extent y = piece(x->x_slab, x->x_kind, p, x->x_base + x->x_size - p);
+          assert(p > x->x_base && p < x->x_base + x->x_size);
+          x->x_size = p - x->x_base;
+          return y;
+     }
+
+     LOCK();
+     extent y = split(x, p);
+     UNLOCK();
+     return y;
+}
+
+/* freeext -- return an extent to the free lists */
+static void freeext(extent x) {
+     code_addr lo = x->x_base, hi = x->x_base + x->x_size;
+
+     if (x->x_slab != NULL) {
+          slab t = unpiece(x);
+          if (t != NULL) retire(t);
+          return;
+     }
+
+     if (x->x_next != NULL && x->x_next->x_free) {
+          unlink_free(x->x_next);
+          merge(x);
+     }
+
+     if (x->x_prev != NULL && x->x_prev->x_free) {
+          extent y = x->x_prev;
+          unlink_free(y);
+          merge(y);
+          x = y;
+     }
+
+     if (x->x_prev == NULL && x->x_next == NULL && !heapof(x)->arena) {
+          /* The whole chunk is free */
+          if (x->x_space != &space0) {
+               giveback(x);
+               return;
+          }
+
+          if (x->x_kind == CODEMEM) unpend(x->x_base);
+          heapof(x)->reserved -= x->x_size;
+          vm_free(x->x_base, x->x_size);
+          free(x);
+          return;
+     }
+
+     /* Pages that were already free have been released before */
+     release(x, lo, hi);
+     link_free(x);
+}
+
+/* vm_freeext -- return an extent to the free lists */
+void vm_freeext(extent x) {
+     if (x->x_slab != NULL) {
+          slab t = unpiece(x);
+          if (t != NULL) {
+               LOCK();
+               retire(t);
+               UNLOCK();
+          }
+          return;
+     }
+
+     LOCK();
+     freeext(x);
+     UNLOCK();
+}
+
+
+/* Each procedure has a record, found by hashing the entry address,
+   that lists the extents it owns and the references that were
+   installed in compiling it.  Extents that are claimed while no
+   procedure is being compiled have no owner and are never freed.
+   References at patchable sites are marked with SITE in r_kind, and
+   numbered in order within the procedure. */
+
+struct _proc {
+     code_addr p_entry;         /* Entry address */
+     char *p_name;              /* Name given to vm_begin */
+     extent p_extents;          /* Extents owned by the procedure */
+     reloc *p_relocs;           /* References installed */
+     int p_nrelocs, p_maxrelocs;
+     int p_fixed;               /* Whether the code must not move */
+     int p_nsites;              /* Number of patchable sites */
+     int p_lits, p_stubs, p_chains, p_saved, p_short; /* For vm_procstats */
+     proc p_next;               /* Next in hash chain */
+};
+
+static THREAD proc curproc;     /* Procedure being compiled */
+static int ncompiling;          /* Procedures being compiled by all threads */
+
+/* Counts made by each thread are added to the totals when it
+   finishes a procedure */
+THREAD struct vm_stats vm_count;
+static struct vm_stats total;
+
+/* fold -- add the counts made by this thread to the totals */
+static void fold(void) {
+     total.literal_bytes += vm_count.literal_bytes;
+     total.stub_bytes += vm_count.stub_bytes;
+     total.chains += vm_count.chains;
+     total.peephole_bytes += vm_count.peephole_bytes;
+     total.relax_bytes += vm_count.relax_bytes;
+     total.scratch_reserved += vm_count.scratch_reserved;
+     if (vm_count.scratch_peak > total.scratch_peak)
+          total.scratch_peak = vm_count.scratch_peak;
+     vm_count.literal_bytes = vm_count.stub_bytes = vm_count.chains = 0;
+     vm_count.peephole_bytes = vm_count.relax_bytes = 0;
+     vm_count.scratch_reserved = 0;
+}
+
+/* vm_countscratch -- add to the scratch memory in use by all threads */
+void vm_countscratch(int n) {
+     __atomic_add_fetch(&total.scratch_used, n, __ATOMIC_RELAXED);
+}
+
+/* uncount -- take a procedure that is freed out of the totals */
+static void uncount(proc p) {
+     total.literal_bytes -= p->p_lits;
+     total.stub_bytes -= p->p_stubs;
+     total.chains -= p->p_chains;
+     total.nprocs--;
+}
+
+#define hash(entry) ((unsigned) ((ptr) (entry) >> 4) % HSIZE)
+
+/* vm_startproc -- begin recording extents for a new procedure */
+void vm_startproc(void) {
+     curproc = (proc) malloc(sizeof(struct _proc));
+     if (curproc == NULL) vm_panic("out of memory");
+     curproc->p_entry = NULL;
+     curproc->p_name = NULL;
+     curproc->p_extents = NULL;
+     curproc->p_relocs = NULL;
+     curproc->p_nrelocs = curproc->p_maxrelocs = 0;
+     curproc->p_fixed = 0;
+     curproc->p_nsites = 0;
+     curproc->p_next = NULL;
+     curproc->p_lits = vm_count.literal_bytes;
+     curproc->p_stubs = vm_count.stub_bytes;
+     curproc->p_chains = vm_count.chains;
+     curproc->p_saved = vm_count.peephole_bytes;
+     curproc->p_short = vm_count.relax_bytes;
+     __atomic_add_fetch(&ncompiling, 1, __ATOMIC_RELAXED);
+}
+
+/* vm_own -- give an extent to the procedure being compiled */
+void vm_own(extent x) {
+     if (curproc == NULL) return;
+     x->x_link = curproc->p_extents;
+     curproc->p_extents = x;
+}
+
+/* vm_pin -- mark an extent that must not be moved */
+void vm_pin(extent x) {
+     x->x_pinned = 1;
+}
+
+/* vm_pinproc -- mark the current procedure as one that must not move */
+void vm_pinproc(void) {
+     if (curproc != NULL) curproc->p_fixed = 1;
+}
+
+/* addreloc -- record a reference in a procedure */
+static void addreloc(proc p, int kind, code_addr loc, code_addr val) {
+     if (p->p_nrelocs >= p->p_maxrelocs) {
+          p->p_maxrelocs = (p->p_maxrelocs == 0 ? 64 : 2*p->p_maxrelocs);
+          p->p_relocs = (reloc *) realloc(p->p_relocs,
+                                          p->p_maxrelocs * sizeof(reloc));
+          if (p->p_relocs == NULL) vm_panic("out of memory");
+     }
+
+     reloc *r = &p->p_relocs[p->p_nrelocs++];
+     r->r_kind = kind; r->r_loc = loc; r->r_val = val;
+}
+
+/* vm_note -- record a reference in the current procedure */
+void vm_note(int kind, code_addr loc, code_addr val) {
+     if (curproc != NULL) addreloc(curproc, kind, loc, val);
+}
+
+/* vm_relocs -- the references recorded for the current procedure */
+reloc *vm_relocs(int *n) {
+     proc p = curproc;
+     if (p == NULL) { *n = 0; return NULL; }
+     *n = p->p_nrelocs;
+     return p->p_relocs;
+}
+
+/* vm_notesite -- record a patchable reference in the current
+   procedure and return its number.  Sites must stay aligned, so the
+   procedure is not moved by vm_compact. */
+int vm_notesite(int kind, code_addr loc, code_addr val) {
+     proc p = curproc;
+     if (p == NULL) vm_panic("patchable site outside a procedure");
+     vm_note(kind | SITE, loc, val);
+     p->p_fixed = 1;
+     return p->p_nsites++;
+}
+
+/* procstats -- count the space used by a procedure */
+static void procstats(proc p, struct vm_procstats *s) {
+     s->code = s->data = 0;
+     for (extent x = p->p_extents; x != NULL; x = x->x_link) {
+          if (x->x_kind == DATAMEM)
+               s->data += x->x_size;
+          else if (!x->x_pinned)
+               s->code += x->x_size;
+     }
+     s->literal_bytes = p->p_lits;
+     s->stub_bytes = p->p_stubs;
+     s->chains = p->p_chains;
+     s->peephole_bytes = p->p_saved;
+     s->relax_bytes = p->p_short;
+}
+
+/* The procedures are also listed by address, in a table that can be
+   searched without locking, even by a signal handler.  A table is
+   never changed once it is published: a new one is made instead, and
+   the old one is kept, together with the names of procedures that
+   have gone, until no reader can be looking at it.  A reader
+   announces itself by incrementing readers before it fetches the
+   table, so anything retired before a moment when readers is zero
+   can be freed then.
+
+   So that each change is cheap, a table has a big base list, shared
+   with the tables before it, and short lists of spans added since the
+   base was made and of spans in the base that have gone.  The lists
+   are merged into a new base when they grow longer than about the
+   square root of its size. */
+
+typedef struct {
+     code_addr sp_lo, sp_hi;    /* Executable addresses of a piece */
+     code_addr sp_entry;        /* Procedure entry */
+     const char *sp_name;       /* Procedure name */
+} span;
+
+typedef struct {
+     int sv_n;                  /* Number of spans */
+     span sv_span[];            /* Spans in order of address */
+} spanvec;
+
+typedef struct {
+     spanvec *pt_base;          /* Spans when the base was made */
+     spanvec *pt_added;         /* Spans added since then */
+     spanvec *pt_gone;          /* Spans in the base that have gone */
+} pctable;
+
+typedef struct _garbage *garbage;
+
+struct _garbage {
+     void *g_ptr;               /* Block to free */
+     garbage g_next;
+};
+
+static pctable *pctab;          /* Current table, or NULL */
+static int readers;             /* Lookups in progress */
+static garbage retired;         /* Blocks waiting to be freed */
+
+/* defer -- free a block once no reader can be using it */
+static void defer(void *p) {
+     if (p == NULL) return;
+     garbage g = (garbage) malloc(sizeof(struct _garbage));
+     if (g == NULL) vm_panic("out of memory");
+     g->g_ptr = p; g->g_next = retired;
+     retired = g;
+}
+
+/* publish -- install a new table, and free what is safe to free */
+static void publish(pctable *t) {
+     pctable *old = __atomic_exchange_n(&pctab, t, __ATOMIC_SEQ_CST);
+
+     if (old != NULL) {
+          if (old->pt_base != t->pt_base) defer(old->pt_base);
+          defer(old->pt_added); defer(old->pt_gone); defer(old);
+     }
+
+     if (__atomic_load_n(&readers, __ATOMIC_SEQ_CST) > 0) return;
+
+     while (retired != NULL) {
+          garbage g = retired;
+          retired = g->g_next;
+          free(g->g_ptr);
+          free(g);
+     }
+}
+
+/* newvec -- allocate a list with room for n spans, copying v if it
+   is not NULL */
+static spanvec *newvec(int n, spanvec *v) {
+     int k = (v == NULL ? 0 : v->sv_n);
+     spanvec *w = (spanvec *) malloc(sizeof(spanvec) + (k+n) * sizeof(span));
+     if (w == NULL) vm_panic("out of memory");
+     w->sv_n = k;
+     if (k > 0) memcpy(w->sv_span, v->sv_span, k * sizeof(span));
+     return w;
+}
+
+/* insert -- add a span to a list with room for it, keeping the order */
+static void insert(spanvec *v, span *r) {
+     int i = v->sv_n++;
+     while (i > 0 && v->sv_span[i-1].sp_lo > r->sp_lo) {
+          v->sv_span[i] = v->sv_span[i-1];
+          i--;
+     }
+     v->sv_span[i] = *r;
+}
+
+/* search -- index of the last span that starts at or before a, or -1 */
+static int search(spanvec *v, code_addr a) {
+     int i = 0, j = v->sv_n;
+
+     /* Invariant: spans [0..i) start at or before a, and spans
+        [j..n) start after it */
+     while (i < j) {
+          int k = (i+j)/2;
+          if (v->sv_span[k].sp_lo <= a)
+               i = k+1;
+          else
+               j = k;
+     }
+
+     return i-1;
+}
+
+/* newspan -- make the span for an extent of a procedure */
+static span newspan(proc p, extent x) {
+     span r;
+     r.sp_lo = xaddr(x->x_base); r.sp_hi = xaddr(x->x_base + x->x_size);
+     r.sp_entry = p->p_entry; r.sp_name = p->p_name;
+     return r;
+}
+
+/* nspans -- count the spans for a procedure */
+static int nspans(proc p) {
+     int n = 0;
+     for (extent x = p->p_extents; x != NULL; x = x->x_link)
+          if (x->x_kind == CODEMEM) n++;
+     return n;
+}
+
+/* cmpspan -- compare spans by address for qsort */
+static int cmpspan(const void *a, const void *b) {
+     code_addr x = ((const span *) a)->sp_lo, y = ((const span *) b)->sp_lo;
+     return (x < y ? -1 : x > y ? 1 : 0);
+}
+
+/* slack -- whether a table has too much in its short lists */
+static int slack(pctable *t) {
+     int k = 64;
+     while (k*k < t->pt_base->sv_n) k *= 2;
+     return (t->pt_added->sv_n + t->pt_gone->sv_n > k);
+}
+
+/* rebase -- merge the short lists of a table that is not yet
+   published into a new base */
+static void rebase(pctable *t) {
+     spanvec *b = t->pt_base, *a = t->pt_added, *g = t->pt_gone;
+     spanvec *v = newvec(b->sv_n + a->sv_n, NULL);
+     int i = 0, j = 0, k = 0;
+
+     while (i < b->sv_n || j < a->sv_n) {
+          if (j < a->sv_n
+              && (i >= b->sv_n || a->sv_span[j].sp_lo < b->sv_span[i].sp_lo))
+               v->sv_span[v->sv_n++] = a->sv_span[j++];
+          else {
+               span *r = &b->sv_span[i++];
+               while (k < g->sv_n && g->sv_span[k].sp_lo < r->sp_lo) k++;
+               if (k < g->sv_n && g->sv_span[k].sp_lo == r->sp_lo) continue;
+               v->sv_span[v->sv_n++] = *r;
+          }
+     }
+
+     free(a); free(g);
+     t->pt_base = v;
+     t->pt_added = newvec(0, NULL);
+     t->pt_gone = newvec(0, NULL);
+}
+
+/* relist -- make the table afresh from all procedures */
+static void relist(void) {
+     int n = 0;
+     pctable *t = (pctable *) malloc(sizeof(pctable));
+     if (t == NULL) vm_panic("out of memory");
+
+     for (vm_codespace s = &space0; s != NULL; s = s->s_next)
+          for (int h = 0; h < HSIZE; h++)
+               for (proc p = s->s_procs[h]; p != NULL; p = p->p_next)
+                    n += nspans(p);
+
+     t->pt_base = newvec(n, NULL);
+     for (vm_codespace s = &space0; s != NULL; s = s->s_next)
+          for (int h = 0; h < HSIZE; h++)
+               for (proc p = s->s_procs[h]; p != NULL; p = p->p_next)
+                    for (extent x = p->p_extents; x != NULL; x = x->x_link)
+                         if (x->x_kind == CODEMEM)
+                              t->pt_base->sv_span[t->pt_base->sv_n++] =
+                                   newspan(p, x);
+
+     qsort(t->pt_base->sv_span, n, sizeof(span), cmpspan);
+     t->pt_added = newvec(0, NULL);
+     t->pt_gone = newvec(0, NULL);
+     publish(t);
+}
+
+/* enlist -- add a procedure to the table, once it is in the hash table */
+static void enlist(proc p) {
+     pctable *old = pctab, *t;
+     int n = nspans(p);
+
+     if (old == NULL) {
+          relist();
+          return;
+     }
+
+     t = (pctable *) malloc(sizeof(pctable));
+     if (t == NULL) vm_panic("out of memory");
+     t->pt_base = old->pt_base;
+     t->pt_added = newvec(n, old->pt_added);
+     t->pt_gone = newvec(0, old->pt_gone);
+     for (extent x = p->p_extents; x != NULL; x = x->x_link) {
+          if (x->x_kind != CODEMEM) continue;
+          span r = newspan(p, x);
+          insert(t->pt_added, &r);
+     }
+
+     if (slack(t)) rebase(t);
+     publish(t);
+}
+
+/* delist -- remove a procedure from the table, after taking it out of
+   the hash table */
+static void delist(proc p) {
+     pctable *old = pctab, *t;
+     int n = nspans(p);
+
+     if (old == NULL) return;
+
+     t = (pctable *) malloc(sizeof(pctable));
+     if (t == NULL) vm_panic("out of memory");
+     t->pt_base = old->pt_base;
+     t->pt_gone = newvec(n, old->pt_gone);
+
+     /* Each span is either among those added or in the base */
+     spanvec *a = old->pt_added;
+     t->pt_added = newvec(a->sv_n, NULL);
+     for (int i = 0; i < a->sv_n; i++) {
+          if (a->sv_span[i].sp_entry != p->p_entry)
+               t->pt_added->sv_span[t->pt_added->sv_n++] = a->sv_span[i];
+     }
+
+     for (extent x = p->p_extents; x != NULL; x = x->x_link) {
+          if (x->x_kind != CODEMEM) continue;
+          int k = search(t->pt_base, xaddr(x->x_base));
+          if (k >= 0 && t->pt_base->sv_span[k].sp_lo == xaddr(x->x_base)
+              && t->pt_base->sv_span[k].sp_entry == p->p_entry)
+               insert(t->pt_gone, &t->pt_base->sv_span[k]);
+     }
+
+     if (slack(t)) rebase(t);
+     publish(t);
+}
+
+/* vm_lookup_pc -- find the procedure containing a code address */
+int vm_lookup_pc(void *addr, struct vm_procinfo *info) {
+     code_addr a = (code_addr) addr;
+     span *r = NULL;
+     int k;
+
+     __atomic_add_fetch(&readers, 1, __ATOMIC_SEQ_CST);
+     pctable *t = __atomic_load_n(&pctab, __ATOMIC_SEQ_CST);
+
+     if (t != NULL) {
+          /* Look first among the spans added, since they may use
+             memory of spans in the base that have gone */
+          k = search(t->pt_added, a);
+          if (k >= 0 && a < t->pt_added->sv_span[k].sp_hi)
+               r = &t->pt_added->sv_span[k];
+          else {
+               k = search(t->pt_base, a);
+               if (k >= 0 && a < t->pt_base->sv_span[k].sp_hi) {
+                    r = &t->pt_base->sv_span[k];
+                    k = search(t->pt_gone, a);
+                    if (k >= 0 && t->pt_gone->sv_span[k].sp_lo == r->sp_lo)
+                         r = NULL;
+               }
+          }
+
+          if (r != NULL) {
+               info->name = r->sp_name;
+               info->entry = r->sp_entry;
+               info->start = r->sp_lo; info->end = r->sp_hi;
+          }
+     }
+
+     __atomic_sub_fetch(&readers, 1, __ATOMIC_SEQ_CST);
+     return (r != NULL);
+}
+
+/* vm_finishproc -- file the record for a completed procedure */
+void vm_finishproc(code_addr entry, const char *name) {
+     unsigned h = hash(entry);
+     struct vm_procstats s;
+     curproc->p_entry = entry;
+     curproc->p_name = (name == NULL ? NULL : strdup(name));
+     curproc->p_lits = vm_count.literal_bytes - curproc->p_lits;
+     curproc->p_stubs = vm_count.stub_bytes - curproc->p_stubs;
+     curproc->p_chains = vm_count.chains - curproc->p_chains;
+     curproc->p_saved = vm_count.peephole_bytes - curproc->p_saved;
+     curproc->p_short = vm_count.relax_bytes - curproc->p_short;
+     procstats(curproc, &s);
+
+     LOCK();
+     fold();
+     curproc->p_next = space->s_procs[h];
+     space->s_procs[h] = curproc;
+     if (s.code > total.proc_peak) total.proc_peak = s.code;
+     total.nprocs++;
+     enlist(curproc);
+     UNLOCK();
+
+     __atomic_sub_fetch(&ncompiling, 1, __ATOMIC_RELEASE);
+
+     curproc = NULL;
+}
+
+/* freeproc -- free a procedure record and the memory it owns */
+static void freeproc(proc p) {
+     extent x = p->p_extents;
+     while (x != NULL) {
+          extent y = x->x_link;
+          freeext(x);
+          x = y;
+     }
+
+     free(p->p_relocs);
+     defer(p->p_name);
+     free(p);
+}
+
+/* vm_dropproc -- discard the procedure being compiled */
+void vm_dropproc(void) {
+     if (curproc == NULL) return;
+
+     /* Forget what was counted for it */
+     vm_count.literal_bytes = curproc->p_lits;
+     vm_count.stub_bytes = curproc->p_stubs;
+     vm_count.chains = curproc->p_chains;
+     vm_count.peephole_bytes = curproc->p_saved;
+     vm_count.relax_bytes = curproc->p_short;
+
+     LOCK();
+     freeproc(curproc);
+     UNLOCK();
+     __atomic_sub_fetch(&ncompiling, 1, __ATOMIC_RELEASE);
+     curproc = NULL;
+}
+
+/* lookup -- find the link to a procedure record in any space, which
+   is NULL if there is none */
+static proc *lookup(void *entry) {
+     proc *pp = NULL;
+
+     for (vm_codespace s = &space0; s != NULL; s = s->s_next) {
+          pp = &s->s_procs[hash(entry)];
+          while (*pp != NULL && (*pp)->p_entry != (code_addr) entry)
+               pp = &(*pp)->p_next;
+          if (*pp != NULL) break;
+     }
+
+     return pp;
+}
+
+/* vm_free_proc -- release the code and literals of a procedure */
+void vm_free_proc(void *entry) {
+     LOCK();
+     proc *pp = lookup(entry), p = *pp;
+
+     if (p == NULL)
+          vm_panic("vm_free_proc: no procedure at %p", entry);
+     if (p->p_extents != NULL && p->p_extents->x_space->s_shared)
+          vm_panic("vm_free_proc: procedure at %p is shared", entry);
+
+     *pp = p->p_next;
+
+     delist(p);
+     uncount(p);
+     freeproc(p);
+     UNLOCK();
+}
+
+/* vm_retarget -- change the target of a patchable site */
+void vm_retarget(void *entry, int site, void *target) {
+     LOCK();
+     proc p = *lookup(entry);
+
+     if (p == NULL)
+          vm_panic("vm_retarget: no procedure at %p", entry);
+     if (site < 0 || site >= p->p_nsites)
+          vm_panic("vm_retarget: no site %d in procedure at %p",
+                   site, entry);
+
+     /* Find the reference and alter the record, so that it is fixed up
+        properly if the new target moves */
+     int i = -1;
+     for (int n = 0; n <= site; n++)
+          do i++; while (!(p->p_relocs[i].r_kind & SITE));
+     reloc *r = &p->p_relocs[i];
+     r->r_val = (code_addr) target;
+     vm_repatch(r->r_kind & ~SITE, r->r_loc, r->r_val);
+     UNLOCK();
+
+     if (vm_patch_sync) vm_sync_cores();
+}
+
+/* vm_fillslot -- store the entry address of a procedure in the slot
+   behind a job stub.  The slot is recorded as a reference from the
+   procedure, so that vm_compact fixes it up if the procedure moves. */
+void vm_fillslot(code_addr slot, void *entry) {
+     LOCK();
+     proc p = *lookup(entry);
+     if (p != NULL)
+          addreloc(p, (sizeof(ptr) == 8 ? ABS64 : ABS), slot, entry);
+     __atomic_store_n((ptr *) slot, (ptr) entry, __ATOMIC_RELEASE);
+     UNLOCK();
+}
+
+
+/* Moving code: a list of moves, each giving a range [m_lo, m_hi) of
+   writable addresses and the distance it has moved, is used to adjust
+   the recorded references, which are then installed again. */
+
+typedef struct {
+     code_addr m_lo, m_hi;      /* Old location */
+     ptr m_delta;               /* Distance moved */
+     extent m_old, m_new;       /* Old and new extents */
+} move;
+
+/* find -- find the move that affects an address, or return NULL */
+static move *find(move *m, int n, code_addr p) {
+     int a = 0, b = n;
+
+     /* Invariant: m[0..a) are before p and m[b..n) are after it */
+     while (a < b) {
+          int k = (a+b)/2;
+          if (p < m[k].m_lo)
+               b = k;
+          else if (p >= m[k].m_hi)
+               a = k+1;
+          else
+               return &m[k];
+     }
+
+     return NULL;
+}
+
+/* fixup -- adjust the references made by a procedure */
+static void fixup(proc p, move *m, int n) {
+     for (int i = 0; i < p->p_nrelocs; i++) {
+          reloc *r = &p->p_relocs[i];
+          move *m1 = find(m, n, r->r_loc);
+          move *m2 = find(m, n, (code_addr) ((ptr) r->r_val - vm_xoff));
+          if (m1 == NULL && m2 == NULL) continue;
+          if (m1 != NULL) r->r_loc = (code_addr) ((ptr) r->r_loc + m1->m_delta);
+          if (m2 != NULL) r->r_val = (code_addr) ((ptr) r->r_val + m2->m_delta);
+          vm_install(r->r_kind & ~SITE, r->r_loc, r->r_val);
+     }
+}
+
+/* vm_remap -- fix up the current procedure after moving [lo, hi) */
+void vm_remap(code_addr lo, code_addr hi, ptr delta) {
+     move m;
+     m.m_lo = lo; m.m_hi = hi; m.m_delta = delta;
+     fixup(curproc, &m, 1);
+}
+
+/* cmpmove -- compare moves by address for qsort */
+static int cmpmove(const void *a, const void *b) {
+     const move *m1 = a, *m2 = b;
+     return (m1->m_lo < m2->m_lo ? -1 : m1->m_lo > m2->m_lo ? 1 : 0);
+}
+
+#define ALIGN 16                /* Alignment of moved code */
+
+/* vm_compact -- move procedures together into dense memory */
+int vm_compact(void (*moved)(void *old, void *new)) {
+     move *m;
+     int n = 0, i, total = 0, nmoved = 0;
+     proc all = NULL;
+
+     /* Other processes may be running shared code */
+     if (space->s_shared) return 0;
+
+     LOCK();
+     if (__atomic_load_n(&ncompiling, __ATOMIC_ACQUIRE) > 0)
+          vm_panic("vm_compact called while compiling");
+
+     /* Take all procedures out of the table */
+     for (int h = 0; h < HSIZE; h++) {
+          proc p = space->s_procs[h], q;
+          while (p != NULL) {
+               q = p->p_next;
+               p->p_next = all; all = p;
+               p = q;
+          }
+          space->s_procs[h] = NULL;
+     }
+
+     /* Find the extents of code that may move */
+     for (proc p = all; p != NULL; p = p->p_next) {
+          if (p->p_fixed) continue;
+          for (extent x = p->p_extents; x != NULL; x = x->x_link)
+               if (x->x_kind == CODEMEM && !x->x_pinned) n++;
+     }
+
+     m = (move *) malloc((n > 0 ? n : 1) * sizeof(move));
+     if (m == NULL) vm_panic("out of memory");
+
+     n = 0;
+     for (proc p = all; p != NULL; p = p->p_next) {
+          if (p->p_fixed) continue;
+          for (extent x = p->p_extents; x != NULL; x = x->x_link) {
+               if (x->x_kind == CODEMEM && !x->x_pinned) {
+                    m[n].m_lo = x->x_base;
+                    m[n].m_hi = x->x_base + x->x_size;
+                    m[n].m_old = x;
+                    total += (x->x_size + ALIGN-1) & ~(ALIGN-1);
+                    n++;
+               }
+          }
+     }
+
+     qsort(m, n, sizeof(move), cmpmove);
+
+     code_addr base = NULL, end = NULL;
+     extent dest = (n > 0 ? getext(space, CODEMEM, total, &base, &end) : NULL);
+     int ok = (dest != NULL);
+
+     if (ok) {
+          /* Copy the code and divide the new space among the extents */
+          code_addr q = base;
+          for (i = 0; i < n; i++) {
+               int size = m[i].m_old->x_size;
+               int step = (size + ALIGN-1) & ~(ALIGN-1);
+               memcpy(q, m[i].m_lo, size);
+               m[i].m_delta = q - m[i].m_lo;
+               m[i].m_new = dest;
+               if (q + step < end) dest = split(dest, q + step);
+               q += step;
+          }
+          if (q < end) freeext(dest);
+
+          /* Fix up every procedure, since any may call one that moved */
+          for (proc p = all; p != NULL; p = p->p_next)
+               fixup(p, m, n);
+
+          /* Give the new extents to the owners in place of the old */
+          for (proc p = all; p != NULL; p = p->p_next) {
+               for (extent x = p->p_extents, *xx = &p->p_extents;
+                    x != NULL; xx = &x->x_link, x = x->x_link) {
+                    move *mm = find(m, n, x->x_base);
+                    if (mm == NULL || mm->m_old != x) continue;
+                    mm->m_new->x_link = x->x_link;
+                    *xx = x = mm->m_new;
+               }
+          }
+
+          for (i = 0; i < n; i++) freeext(m[i].m_old);
+
+          protect();
+#ifdef USE_FLUSH
+          __clear_cache(xaddr(base), xaddr(q));
+#endif
+     }
+
+     /* Put the procedures back under their new entry addresses */
+     while (all != NULL) {
+          proc p = all;
+          all = p->p_next;
+
+          move *mm = (ok ? find(m, n, (code_addr) ((ptr) p->p_entry
+                                                   - vm_xoff)) : NULL);
+          if (mm != NULL) {
+               code_addr old = p->p_entry;
+               p->p_entry = (code_addr) ((ptr) old + mm->m_delta);
+               if (moved != NULL) (*moved)(old, p->p_entry);
+               nmoved++;
+          }
+
+          unsigned h = hash(p->p_entry);
+          p->p_next = space->s_procs[h];
+          space->s_procs[h] = p;
+     }
+
+     if (nmoved > 0) relist();
+
+     UNLOCK();
+     free(m);
+     return nmoved;
+}
+
+
+/* Statistics */
+
+/* vm_stats -- fill in statistics for all memory */
+void vm_stats(struct vm_stats *s) {
+     LOCK();
+     *s = total;
+
+     /* Add what this thread has counted since it last folded */
+     s->literal_bytes += vm_count.literal_bytes;
+     s->stub_bytes += vm_count.stub_bytes;
+     s->chains += vm_count.chains;
+     s->peephole_bytes += vm_count.peephole_bytes;
+     s->relax_bytes += vm_count.relax_bytes;
+     s->scratch_reserved += vm_count.scratch_reserved;
+     s->scratch_used = __atomic_load_n(&total.scratch_used, __ATOMIC_RELAXED);
+     if (vm_count.scratch_peak > s->scratch_peak)
+          s->scratch_peak = vm_count.scratch_peak;
+
+     struct heap *h = space->s_heap;
+     s->code_reserved = h[CODEMEM].reserved;
+     s->code_used = h[CODEMEM].reserved - h[CODEMEM].nfree
+          - unused(&h[CODEMEM]) - idle(&h[CODEMEM]);
+     s->code_peak = h[CODEMEM].peak;
+     s->data_reserved = h[DATAMEM].reserved;
+     s->data_used = h[DATAMEM].reserved - h[DATAMEM].nfree
+          - unused(&h[DATAMEM]) - idle(&h[DATAMEM]);
+     s->data_peak = h[DATAMEM].peak;
+     s->lock_waits = __atomic_load_n(&waits, __ATOMIC_RELAXED);
+     UNLOCK();
+}
+
+/* vm_procstats -- fill in statistics for one procedure */
+int vm_procstats(void *entry, struct vm_procstats *s) {
+     LOCK();
+     proc p = *lookup(entry);
+     if (p != NULL) procstats(p, s);
+     UNLOCK();
+     return (p != NULL);
+}
+
+
+/* Code spaces */
+
+/* vm_new_codespace -- create an empty code space */
+vm_codespace vm_new_codespace(void) {
+     vm_codespace s = (vm_codespace) calloc(1, sizeof(struct _codespace));
+     if (s == NULL) vm_panic("out of memory");
+     LOCK();
+     s->s_next = space0.s_next;
+     space0.s_next = s;
+     UNLOCK();
+     return s;
+}
+
+/* vm_shared_codespace -- make a space whose memory of each kind k is
+   the part of a file from top[k] to end[k].  Other processes may take
+   memory from the same file, so the tops are kept there and advanced
+   atomically, and memory is never given back to the file. */
+vm_codespace vm_shared_codespace(code_addr top[2], code_addr end[2]) {
+     vm_codespace s = vm_new_codespace();
+
+     for (int k = 0; k < 2; k++) {
+          struct heap *h = &s->s_heap[k];
+          h->ready = h->arena = 1;
+          h->front = &top[k]; h->end = end[k];
+          h->reserved = end[k] - top[k];
+     }
+
+     s->s_shared = 1;
+     return s;
+}
+
+/* vm_set_codespace -- choose the space for new procedures */
+void vm_set_codespace(vm_codespace s) {
+     if (s == NULL) s = &space0;
+     if (s == space) return;
+     if (curproc != NULL)
+          vm_panic("vm_set_codespace called while compiling");
+     vm_dropbufs();
+     space = s;
+}
+
+/* vm_free_codespace -- destroy a code space and everything in it */
+void vm_free_codespace(vm_codespace s) {
+     vm_codespace *ss = &space0.s_next;
+
+     if (s == &space0)
+          vm_panic("the first code space cannot be freed");
+     if (s->s_shared)
+          vm_panic("a shared code space cannot be freed");
+     if (s == space) vm_set_codespace(NULL);
+
+     LOCK();
+     while (*ss != s) ss = &(*ss)->s_next;
+     *ss = s->s_next;
+
+     /* Forget the procedures without freeing their extents one by one */
+     for (int h = 0; h < HSIZE; h++) {
+          proc p = s->s_procs[h], q;
+          while (p != NULL) {
+               q = p->p_next;
+               uncount(p);
+               free(p->p_relocs);
+               defer(p->p_name);
+               free(p);
+               p = q;
+          }
+     }
+
+     /* Give back every block, used or not */
+     while (s->s_blocks != NULL) {
+          block b = s->s_blocks;
+          s->s_blocks = b->b_next;
+          for (extent x = b->b_first, y; x != NULL; x = y) {
+               y = x->x_next;
+               free(x);
+          }
+          freeext(b->b_parent);
+          free(b);
+     }
+
+     relist();
+     UNLOCK();
+
+     free(s);
+}
@@ -0,0 +1,183 @@
+/*
+ * dead.c
+ * 
+ * This file is part of the Oxford Oberon-2 compiler
+ * Copyright (c) 2006--2016 J. M. Spivey
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "vm.h"
+#include "vminternal.h"
+#include <string.h>
+
+/* Before translation, blocks of the record that cannot be reached are
+   left out, and so are instructions that set a register that is not
+   used afterwards.  A block is reached if control can pass to it from
+   the start of the procedure, and the targets of jump tables and
+   labels whose address is taken are counted as reached, as are blocks
+   that contain a site, since sites are numbered in the order they are
+   recorded.  Liveness is found for virtual registers and for the
+   registers the client can name; at the end of the procedure only the
+   result register is live, and at a jump that may leave the procedure
+   all of them are.  Only instructions that do nothing but set their
+   result are removed: loads are kept in case they fault, and so are
+   GETARG instructions, which must come first. */
+
+int vm_deadcode = 1;            /* Whether to remove dead code */
+
+/* Variable for each physical register the client can name, or -1 */
+static THREAD int pvar[NPHYS];
+
+#define var(r) vm_irvar(r, pvar)
+
+/* setnamed -- give a variable to a register the client can name */
+static void setnamed(vmreg r, int nreg) {
+     int k = r->vr_reg;
+     if (k >= 0 && k < NPHYS) pvar[k] = nreg + k;
+}
+
+/* pure -- test if instruction i does nothing but set its result */
+static int pure(int i) {
+     int op = vm_ir.op[i];
+
+     switch (vm_ir.form[i]) {
+     case IR_1R:
+          return (op == ZEROf || op == ZEROd);
+     case IR_2RR: case IR_2RI: case IR_2RJ:
+     case IR_3RRR: case IR_3RRI:
+          return (!isload(op) && !isstore(op) && op != GETARG);
+     default:
+          return 0;
+     }
+}
+
+/* reach -- find the blocks that can be reached */
+static unsigned char *reach(void) {
+     int nblock = vm_nblock, sp = 0;
+     unsigned char *seen = (unsigned char *) vm_scratch(nblock);
+     int *stack = (int *) vm_scratch(nblock * sizeof(int));
+
+#define visit(k) \
+     if ((k) >= 0 && !seen[k]) seen[k] = 1, stack[sp++] = (k)
+
+     memset(seen, 0, nblock);
+     if (nblock > 0) { visit(0); }
+     for (int s = 0; s < vm_ntaken; s++) { visit(vm_taken[s]); }
+     for (int k = 0; k < nblock; k++) {
+          for (int i = vm_block[k].first; i <= vm_block[k].last; i++) {
+               if (vm_ir.form[i] == IR_SITE) { visit(k); break; }
+          }
+     }
+
+     while (sp > 0) {
+          struct irblock *bk = &vm_block[stack[--sp]];
+          visit(bk->succ[0]);
+          visit(bk->succ[1]);
+     }
+
+#undef visit
+     return seen;
+}
+
+/* vm_dead_code -- remove unreachable blocks and dead instructions */
+void vm_dead_code(int nr) {
+     int n = vm_ir.n, nvar, nw, which[3], def[3];
+     unsigned char *seen, *dead;
+     unsigned *in, *out, *ret, *away, *live;
+     int retvar;
+
+     vm_ir_blocks();
+     seen = reach();
+
+     for (int k = 0; k < NPHYS; k++) pvar[k] = -1;
+     for (int i = 0; i < vm_nireg; i++) setnamed(vm_ireg[i], nr);
+     for (int i = 0; i < vm_nfreg; i++) setnamed(vm_freg[i], nr);
+     setnamed(vm_ret, nr);
+
+     nvar = nr + NPHYS; nw = (nvar+31)/32;
+     ret = (unsigned *) vm_scratch(nw * sizeof(unsigned));
+     away = (unsigned *) vm_scratch(nw * sizeof(unsigned));
+     memset(ret, 0, nw * sizeof(unsigned));
+     memset(away, 0, nw * sizeof(unsigned));
+     retvar = var(vm_ret);
+     if (retvar >= 0) setbit(ret, retvar);
+     for (int k = 0; k < NPHYS; k++)
+          if (pvar[k] >= 0) setbit(away, pvar[k]);
+
+     in = (unsigned *) vm_scratch(vm_nblock * nw * sizeof(unsigned));
+     out = (unsigned *) vm_scratch(vm_nblock * nw * sizeof(unsigned));
+     vm_ir_live(nw, pvar, retvar, ret, away, in, out);
+
+     /* Work backwards through each block to find dead results */
+     dead = (unsigned char *) vm_scratch(n);
+     memset(dead, 0, n);
+     live = (unsigned *) vm_scratch(nw * sizeof(unsigned));
+     for (int k = 0; k < vm_nblock; k++) {
+          struct irblock *bk = &vm_block[k];
+
+          if (!seen[k]) {
+               /* Jump table entries are data, and stay */
+               for (int i = bk->first; i <= bk->last; i++)
+                    dead[i] = (vm_ir.form[i] != IR_CASE);
+               continue;
+          }
+
+          memcpy(live, out + k*nw, nw * sizeof(unsigned));
+          for (int i = bk->last; i >= bk->first; i--) {
+               int m = vm_operands(i, which, def);
+
+               if (m > 0 && def[0] && pure(i)) {
+                    int v = var(vm_rand(i, which[0]));
+                    if (v >= 0 && !getbit(live, v)) {
+                         dead[i] = 1; continue;
+                    }
+               }
+
+               for (int j = 0; j < m; j++) {
+                    int v = var(vm_rand(i, which[j]));
+                    if (v >= 0 && def[j]) clrbit(live, v);
+               }
+               if (retvar >= 0 && iscall(vm_ir.form[i], vm_ir.op[i]))
+                    clrbit(live, retvar);
+               for (int j = 0; j < m; j++) {
+                    int v = var(vm_rand(i, which[j]));
+                    if (v >= 0 && !def[j]) setbit(live, v);
+               }
+          }
+     }
+
+     /* Compact the record */
+     int j = 0;
+     for (int i = 0; i < n; i++) {
+          if (dead[i]) continue;
+          vm_ir.op[j] = vm_ir.op[i]; vm_ir.form[j] = vm_ir.form[i];
+          vm_ir.s[j] = vm_ir.s[i];
+          vm_ir.a[j] = vm_ir.a[i]; vm_ir.b[j] = vm_ir.b[i];
+          vm_ir.c[j] = vm_ir.c[i];
+          j++;
+     }
+     vm_ir.n = j;
+}
@@ -0,0 +1,315 @@
+/*
+ * fold.c
+ * 
+ * This file is part of the Oxford Oberon-2 compiler
+ * Copyright (c) 2006--2016 J. M. Spivey
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "vm.h"
+#include "vminternal.h"
+#include <string.h>
+
+/* Constants are propagated forward through each extended basic block
+   of the record: a register set by MOV from a constant is known until
+   it is set again, or until a label, where other paths may join.
+   Known operands become immediates, arithmetic on constants is done
+   at once, and branches that are sure to be taken become jumps, and
+   those that cannot be are left out.  Only integer registers are
+   followed, and only 32-bit operations; a CALL forgets all physical
+   registers, since the called routine may change them. */
+
+int vm_fold = 1;                /* Whether to fold constants */
+
+static THREAD int nreg;         /* Virtual registers */
+static THREAD unsigned *stamp;  /* Known if equal to the current age */
+static THREAD int *value;       /* Value where known */
+static THREAD unsigned age;
+static THREAD unsigned char isint[NPHYS];
+
+/* slot -- index for an integer register, or -1 */
+static inline int slot(ptr x) {
+     int k = ((vmreg) x)->vr_reg;
+     if (k >= VIRTUAL)
+          return ((k & 1) == VM_INT ? NPHYS + ((k - VIRTUAL) >> 1) : -1);
+     if (k >= 0 && k < NPHYS && isint[k]) return k;
+     return -1;
+}
+
+/* known -- test if a register holds a known value */
+static inline int known(ptr x, int *v) {
+     int s = slot(x);
+     if (s < 0 || stamp[s] != age) return 0;
+     *v = value[s];
+     return 1;
+}
+
+/* setval -- note the value of a register */
+static inline void setval(ptr x, int v) {
+     int s = slot(x);
+     if (s < 0) return;
+     stamp[s] = age; value[s] = v;
+}
+
+/* forget -- note that a register is no longer known */
+static inline void forget(ptr x) {
+     int s = slot(x);
+     if (s >= 0) stamp[s] = 0;
+}
+
+/* forgetall -- forget every register, as at a label */
+static void forgetall(void) {
+     if (++age == 0) {
+          memset(stamp, 0, (NPHYS + nreg) * sizeof(unsigned));
+          age = 1;
+     }
+}
+
+/* eval -- compute an operation on constants if it is safe */
+static int eval(operation op, int b, int c, int *r) {
+     unsigned x = b, y = c;
+
+     switch (op) {
+     case ADD: *r = x + y; break;
+     case SUB: *r = x - y; break;
+     case MUL: *r = x * y; break;
+     case AND: *r = x & y; break;
+     case OR:  *r = x | y; break;
+     case XOR: *r = x ^ y; break;
+
+     /* The machines differ for shifts of 32 or more */
+     case LSH:  if (y >= 32) return 0; *r = x << y; break;
+     case RSH:  if (y >= 32) return 0; *r = b >> y; break;
+     case RSHu: if (y >= 32) return 0; *r = x >> y; break;
+     case ROR:
+          if (y >= 32) return 0;
+          *r = (y == 0 ? x : (x >> y) | (x << (32-y)));
+          break;
+
+     case EQ: *r = (b == c); break;
+     case NE: *r = (b != c); break;
+     case LT: *r = (b < c); break;
+     case LE: *r = (b <= c); break;
+     case GT: *r = (b > c); break;
+     case GE: *r = (b >= c); break;
+
+     default:
+          return 0;
+     }
+
+     return 1;
+}
+
+/* test -- decide a conditional branch on constants, or return -1 */
+static int test(operation op, int a, int b) {
+     unsigned x = a, y = b;
+
+     switch (op) {
+     case BEQ: return (a == b);
+     case BNE: return (a != b);
+     case BLT: return (a < b);
+     case BLE: return (a <= b);
+     case BGT: return (a > b);
+     case BGE: return (a >= b);
+     case BLTu: return (x < y);
+     case BLEu: return (x <= y);
+     case BGTu: return (x > y);
+     case BGEu: return (x >= y);
+     default: return -1;
+     }
+}
+
+/* swap -- the operation with its operands exchanged, or -1 */
+static int swap(operation op) {
+     switch (op) {
+     case ADD: case MUL: case AND: case OR: case XOR:
+     case EQ: case NE: case BEQ: case BNE:
+          return op;
+     case LT: return GT;
+     case LE: return GE;
+     case GT: return LT;
+     case GE: return LE;
+     case BLT: return BGT;
+     case BLE: return BGE;
+     case BGT: return BLT;
+     case BGE: return BLE;
+     case BLTu: return BGTu;
+     case BLEu: return BGEu;
+     case BGTu: return BLTu;
+     case BGEu: return BLEu;
+     default: return -1;
+     }
+}
+
+/* immediate -- test if an operation has a form with a constant for
+   its last operand */
+static int immediate(operation op, int c) {
+     switch (op) {
+     case ADD: case SUB: case MUL: case AND: case OR: case XOR:
+     case EQ: case NE: case LT: case LE: case GT: case GE:
+          return 1;
+     case LSH: case RSH: case RSHu: case ROR:
+          return ((unsigned) c < 32);
+     default:
+          return 0;
+     }
+}
+
+#define ismem(op) (isload(op) || isstore(op))
+
+/* vm_fold_consts -- propagate and fold constants in the record */
+void vm_fold_consts(int nr) {
+     struct ir *r = &vm_ir;
+     int n = r->n, j = 0, which[3], def[3];
+
+     nreg = nr;
+     stamp = (unsigned *) vm_scratch((NPHYS + nreg) * sizeof(unsigned));
+     value = (int *) vm_scratch((NPHYS + nreg) * sizeof(int));
+     memset(stamp, 0, (NPHYS + nreg) * sizeof(unsigned));
+     age = 1;
+
+     memset(isint, 0, sizeof(isint));
+     for (int k = 0; k < vm_nireg; k++) isint[vm_ireg[k]->vr_reg] = 1;
+     if (vm_ret->vr_reg < NPHYS) isint[vm_ret->vr_reg] = 1;
+
+     for (int i = 0; i < n; i++) {
+          int form = r->form[i], op = r->op[i], s = r->s[i];
+          ptr a = r->a[i], b = r->b[i], c = r->c[i];
+          int x, y, v;
+
+          switch (form) {
+          case IR_LABEL:
+               forgetall();
+               break;
+
+          case IR_1R:
+               if (op == ARG && known(a, &x)) {
+                    form = IR_1I; a = x;
+               }
+               break;
+
+          case IR_2RI:
+               if (op == MOV) {
+                    setval(a, b);
+                    goto keep;
+               }
+               break;
+
+          case IR_2RR:
+               if (slot(a) < 0 || !known(b, &y)) break;
+               switch (op) {
+               case MOV: v = y; break;
+               case NEG: v = -(unsigned) y; break;
+               case NOT: v = ~y; break;
+               case CONVis: v = (short) y; break;
+               default: goto other;
+               }
+               form = IR_2RI; op = MOV; b = v;
+               setval(a, v);
+               goto keep;
+
+          case IR_3RRR:
+               if (ismem(op)) {
+                    /* Fold a known index or base into the offset */
+                    if (known(c, &y) && known(b, &x)) {
+                         form = IR_2RI; b = x + y;
+                    } else if (known(c, &y)) {
+                         form = IR_3RRI; c = y;
+                    } else if (known(b, &x)) {
+                         form = IR_3RRI; b = c; c = x;
+                    }
+                    break;
+               }
+               if (known(b, &x) && known(c, &y) && eval(op, x, y, &v)) {
+                    form = IR_2RI; op = MOV; b = v;
+                    setval(a, v);
+                    goto keep;
+               }
+               if (known(c, &y) && immediate(op, y)) {
+                    form = IR_3RRI; c = y;
+               } else if (known(b, &x) && swap(op) >= 0
+                          && immediate(swap(op), x)) {
+                    form = IR_3RRI; op = swap(op); b = c; c = x;
+               }
+               break;
+
+          case IR_3RRI:
+               if (!known(b, &x)) break;
+               if (ismem(op)) {
+                    form = IR_2RI; b = x + (int) c;
+                    break;
+               }
+               if (eval(op, x, c, &v)) {
+                    form = IR_2RI; op = MOV; b = v;
+                    setval(a, v);
+                    goto keep;
+               }
+               break;
+
+          case IR_4RRRS:
+               if (known(c, &y)) {
+                    form = IR_3RRI; c = (unsigned) y << s;
+               }
+               break;
+
+          case IR_3RRJ:
+               if (swap(op) < 0) break;
+               if (known(a, &x) && known(b, &y) && test(op, x, y) >= 0) {
+                    if (!test(op, x, y)) continue;
+                    form = IR_1J; op = JUMP; a = c;
+               } else if (known(b, &y)) {
+                    form = IR_3RIJ; b = y;
+               } else if (known(a, &x)) {
+                    form = IR_3RIJ; op = swap(op); a = b; b = x;
+               }
+               break;
+
+          case IR_3RIJ:
+               if (known(a, &x) && test(op, x, b) >= 0) {
+                    if (!test(op, x, b)) continue;
+                    form = IR_1J; op = JUMP; a = c;
+               }
+               break;
+          }
+
+     other:
+          /* Only the first operand is ever set */
+          if (vm_operands(i, which, def) > 0 && def[0]) forget(a);
+
+          if (iscall(form, op))
+               memset(stamp, 0, NPHYS * sizeof(unsigned));
+          else if (form == IR_1J || (op == JUMP
+                                         && (form == IR_1R || form == IR_SITE)))
+               forgetall();
+
+     keep:
+          r->form[j] = form; r->op[j] = op; r->s[j] = s;
+          r->a[j] = a; r->b[j] = b; r->c[j] = c;
+          j++;
+     }
+
+     r->n = j;
+}
@@ -0,0 +1,498 @@
+/*
+ * ir.c
+ * 
+ * This file is part of the Oxford Oberon-2 compiler
+ * Copyright (c) 2006--2016 J. M. Spivey
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "vm.h"
+#include "vminternal.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/* If vm_defer is set when a procedure is begun, the instructions in
+   its body are recorded rather than translated at once, and they are
+   translated only at vm_end.  Passes over the whole procedure can then
+   work on the record.  Labels, jump table entries and patchable sites
+   are recorded in line with the instructions, so that translating the
+   record has the same effect as translating directly. */
+
+int vm_defer = 0;               /* Whether to defer translation */
+
+THREAD struct ir vm_ir;         /* Instructions of the procedure */
+static THREAD struct ir spare;  /* Copy being made by a pass */
+static THREAD int deferring;    /* Whether recording the procedure */
+static THREAD int nsites;       /* Sites recorded so far */
+static THREAD int nvregs;       /* Virtual registers made so far */
+static THREAD int nargs, nlocs; /* Arguments to vm_prelude */
+
+/* grow -- enlarge the arrays of a record */
+static void grow(struct ir *r) {
+     int n = (r->max == 0 ? 256 : 2*r->max);
+
+     r->op = (unsigned char *) realloc(r->op, n);
+     r->form = (unsigned char *) realloc(r->form, n);
+     r->s = (unsigned char *) realloc(r->s, n);
+     r->a = (ptr *) realloc(r->a, n * sizeof(ptr));
+     r->b = (ptr *) realloc(r->b, n * sizeof(ptr));
+     r->c = (ptr *) realloc(r->c, n * sizeof(ptr));
+     if (r->op == NULL || r->form == NULL || r->s == NULL
+         || r->a == NULL || r->b == NULL || r->c == NULL)
+          vm_panic("out of memory");
+     r->max = n;
+}
+
+/* put -- add an instruction to a record, returning its index */
+static inline int put(struct ir *r, int form, operation op,
+                      ptr a, ptr b, ptr c) {
+     if (r->n >= r->max) grow(r);
+     int i = r->n++;
+     r->op[i] = op; r->form[i] = form;
+     r->a[i] = a; r->b[i] = b; r->c[i] = c;
+     return i;
+}
+
+#define record(form, op, a, b, c) put(&vm_ir, form, op, a, b, c)
+
+#define R(x) ((ptr) (x))
+
+void vm_gen1r(operation op, vmreg a) {
+     if (!deferring) { vm_enc1r(op, a); return; }
+     record(IR_1R, op, R(a), 0, 0);
+}
+
+void vm_gen1i(operation op, int a) {
+     if (!deferring) { vm_enc1i(op, a); return; }
+     record(IR_1I, op, R(a), 0, 0);
+}
+
+void vm_gen1a(operation op, void *a) {
+     if (!deferring) { vm_enc1a(op, a); return; }
+     record(IR_1A, op, R(a), 0, 0);
+}
+
+void vm_gen1j(operation op, vmlabel lab) {
+     if (!deferring) { vm_enc1j(op, lab); return; }
+     record(IR_1J, op, R(lab), 0, 0);
+}
+
+void vm_gen2rr(operation op, vmreg a, vmreg b) {
+     if (!deferring) { vm_enc2rr(op, a, b); return; }
+     record(IR_2RR, op, R(a), R(b), 0);
+}
+
+void vm_gen2ri(operation op, vmreg a, int b) {
+     if (!deferring) { vm_enc2ri(op, a, b); return; }
+     record(IR_2RI, op, R(a), R(b), 0);
+}
+
+void vm_gen2rj(operation op, vmreg a, vmlabel b) {
+     if (!deferring) { vm_enc2rj(op, a, b); return; }
+     record(IR_2RJ, op, R(a), R(b), 0);
+}
+
+void vm_gen3rrr(operation op, vmreg a, vmreg b, vmreg c) {
+     if (!deferring) { vm_enc3rrr(op, a, b, c); return; }
+     record(IR_3RRR, op, R(a), R(b), R(c));
+}
+
+void vm_gen3rri(operation op, vmreg a, vmreg b, int c) {
+     if (!deferring) { vm_enc3rri(op, a, b, c); return; }
+     record(IR_3RRI, op, R(a), R(b), R(c));
+}
+
+void vm_gen3rrj(operation op, vmreg a, vmreg b, vmlabel lab) {
+     if (!deferring) { vm_enc3rrj(op, a, b, lab); return; }
+     record(IR_3RRJ, op, R(a), R(b), R(lab));
+}
+
+void vm_gen3rij(operation op, vmreg a, int b, vmlabel lab) {
+     if (!deferring) { vm_enc3rij(op, a, b, lab); return; }
+     record(IR_3RIJ, op, R(a), R(b), R(lab));
+}
+
+void vm_gen4rrrs(operation op, vmreg a, vmreg b, vmreg c, int s) {
+     if (!deferring) { vm_enc4rrrs(op, a, b, c, s); return; }
+     int i = record(IR_4RRRS, op, R(a), R(b), R(c));
+     vm_ir.s[i] = s;
+}
+
+/* vm_label -- place a label */
+void vm_label(vmlabel lab) {
+     if (!deferring) { vm_place(lab); return; }
+     record(IR_LABEL, 0, R(lab), 0, 0);
+}
+
+/* vm_caselab -- add an address to the current jump table */
+void vm_caselab(vmlabel lab) {
+     code_addr loc = vm_caseslot();
+     if (!deferring) { vm_branch(CASELAB, loc, lab); return; }
+     record(IR_CASE, 0, R(lab), R(loc), 0);
+}
+
+/* vm_site -- CALL or JUMP that can be retargeted; sites are numbered
+   in order, so the number is known before translation */
+int vm_site(operation op, void *a) {
+     if (!deferring) return vm_encsite(op, a);
+     record(IR_SITE, op, R(a), 0, 0);
+     return nsites++;
+}
+
+/* vm_newreg -- make a virtual register */
+vmreg vm_newreg(int kind) {
+     if (!deferring) vm_panic("virtual registers need vm_defer");
+     vmreg r = (vmreg) vm_scratch(sizeof(struct _vmreg) + 12);
+     char *name = (char *) (r+1);
+     int k = nvregs++;
+     sprintf(name, "%c%d", (kind == VM_FLOAT ? 'Y' : 'X'), k);
+     r->vr_name = name;
+     r->vr_reg = VIRTUAL + 2*k + (kind == VM_FLOAT);
+     return r;
+}
+
+/* Passes that change the record make an altered copy of it, which
+   then replaces the original */
+
+/* vm_ir_copy -- start a copy of the record */
+struct ir *vm_ir_copy(void) {
+     spare.n = 0;
+     return &spare;
+}
+
+/* vm_ir_put -- add an instruction to a copy */
+void vm_ir_put(struct ir *r, int form, operation op,
+               ptr a, ptr b, ptr c, int s) {
+     int i = put(r, form, op, a, b, c);
+     r->s[i] = s;
+}
+
+/* vm_ir_swap -- make the copy current */
+void vm_ir_swap(void) {
+     struct ir t = vm_ir;
+     vm_ir = spare; spare = t;
+}
+
+/* endsblock -- test if an instruction is a jump or branch */
+static inline int endsblock(int form, int op) {
+     switch (form) {
+     case IR_1J: case IR_3RRJ: case IR_3RIJ:
+          return 1;
+     case IR_1R: case IR_SITE:
+          return (op == JUMP);
+     default:
+          return 0;
+     }
+}
+
+/* Branches to an alias are taken as branches to the label it stands for */
+#define lab(x) vm_labroot((vmlabel) (x))
+
+/* target -- block where a label is placed, or -1 */
+static inline int target(ptr x) {
+     return lab(x)->l_block;
+}
+
+THREAD int vm_nblock, vm_ntaken;
+THREAD struct irblock *vm_block;
+THREAD int *vm_taken;
+
+/* vm_ir_blocks -- divide the record into basic blocks, and set the
+   l_block field of each label to the block where it is placed */
+void vm_ir_blocks(void) {
+     int n = vm_ir.n, nblock = 0, ntaken = 0;
+     unsigned char *form = vm_ir.form, *ops = vm_ir.op;
+     ptr *a = vm_ir.a, *b = vm_ir.b, *c = vm_ir.c;
+     struct irblock *block;
+     int *taken;
+
+     /* Labels may still be marked from an earlier procedure */
+     for (int i = 0; i < n; i++) {
+          switch (form[i]) {
+          case IR_LABEL: case IR_1J: case IR_CASE:
+               lab(a[i])->l_block = -1; break;
+          case IR_2RJ:
+               lab(b[i])->l_block = -1; break;
+          case IR_3RRJ: case IR_3RIJ:
+               lab(c[i])->l_block = -1; break;
+          }
+     }
+
+     block = (struct irblock *) vm_scratch(n * sizeof(struct irblock));
+     for (int i = 0; i < n; i++) {
+          if (i == 0 || endsblock(form[i-1], ops[i-1])
+              || (form[i] == IR_LABEL && form[i-1] != IR_LABEL))
+               block[nblock++].first = i;
+          block[nblock-1].last = i;
+          if (form[i] == IR_LABEL) lab(a[i])->l_block = nblock-1;
+     }
+
+     taken = (int *) vm_scratch(n * sizeof(int));
+     for (int i = 0; i < n; i++) {
+          if (form[i] == IR_CASE && target(a[i]) >= 0)
+               taken[ntaken++] = target(a[i]);
+          else if (form[i] == IR_2RJ && target(b[i]) >= 0)
+               taken[ntaken++] = target(b[i]);
+     }
+
+     for (int k = 0; k < nblock; k++) {
+          struct irblock *bk = &block[k];
+          int j = bk->last, next = (k+1 < nblock ? k+1 : -1);
+          bk->succ[0] = bk->succ[1] = -1;
+          bk->indirect = bk->exit = 0;
+
+          switch (form[j]) {
+          case IR_1J:
+               bk->succ[0] = target(a[j]); break;
+          case IR_3RRJ: case IR_3RIJ:
+               bk->succ[0] = target(c[j]); bk->succ[1] = next; break;
+          case IR_1R: case IR_SITE:
+               if (ops[j] == JUMP) {
+                    /* A jump via a register may reach any taken label,
+                       and either kind may leave the procedure */
+                    bk->indirect = (form[j] == IR_1R);
+                    bk->exit = BLK_AWAY;
+                    break;
+               }
+               /* Fall through */
+          default:
+               bk->succ[0] = next;
+               if (next < 0) bk->exit = BLK_RETURN;
+          }
+     }
+
+     vm_nblock = nblock; vm_block = block;
+     vm_ntaken = ntaken; vm_taken = taken;
+}
+
+/* vm_ir_live -- find the sets of variables live on entry to and exit
+   from each block, as bit vectors of nw words.  Variables are numbered
+   as by vm_irvar with the given map; callvar, if not -1, is set by each call; and
+   the sets ret and away, if not null, are live where a block returns
+   or jumps out of the procedure.  The results in and out each have
+   room for vm_nblock sets. */
+void vm_ir_live(int nw, const int map[], int callvar,
+                const unsigned *ret, const unsigned *away,
+                unsigned *in, unsigned *out) {
+     int nblock = vm_nblock, which[3], def[3];
+     struct irblock *block = vm_block;
+     unsigned size = nblock * nw * sizeof(unsigned);
+     unsigned *gen = (unsigned *) vm_scratch(size);
+     unsigned *kill = (unsigned *) vm_scratch(size);
+     unsigned *t = (unsigned *) vm_scratch(nw * sizeof(unsigned));
+
+     memset(gen, 0, size); memset(kill, 0, size);
+     memset(in, 0, size); memset(out, 0, size);
+
+     /* Registers used in each block before being set, and those set */
+     for (int k = 0; k < nblock; k++) {
+          unsigned *g = gen + k*nw, *x = kill + k*nw;
+          for (int i = block[k].first; i <= block[k].last; i++) {
+               int m = vm_operands(i, which, def), d = -1;
+               for (int j = 0; j < m; j++) {
+                    int v = vm_irvar(vm_rand(i, which[j]), map);
+                    if (v < 0) continue;
+                    if (def[j])
+                         d = v;
+                    else if (!getbit(x, v))
+                         setbit(g, v);
+               }
+               if (d >= 0) setbit(x, d);
+               if (callvar >= 0 && iscall(vm_ir.form[i], vm_ir.op[i]))
+                    setbit(x, callvar);
+          }
+     }
+
+     /* Iterate to a fixed point, working backwards */
+     int changed;
+     do {
+          changed = 0;
+          for (int k = nblock-1; k >= 0; k--) {
+               struct irblock *bk = &block[k];
+               unsigned *o = out + k*nw, *v = in + k*nw;
+               unsigned *g = gen + k*nw, *x = kill + k*nw;
+               const unsigned *e =
+                    (bk->exit == BLK_RETURN ? ret
+                     : bk->exit == BLK_AWAY ? away : NULL);
+
+               if (e != NULL)
+                    memcpy(t, e, nw * sizeof(unsigned));
+               else
+                    memset(t, 0, nw * sizeof(unsigned));
+               for (int s = 0; s < 2; s++) {
+                    if (bk->succ[s] < 0) continue;
+                    unsigned *y = in + bk->succ[s]*nw;
+                    for (int w = 0; w < nw; w++) t[w] |= y[w];
+               }
+               if (bk->indirect) {
+                    for (int s = 0; s < vm_ntaken; s++) {
+                         unsigned *y = in + vm_taken[s]*nw;
+                         for (int w = 0; w < nw; w++) t[w] |= y[w];
+                    }
+               }
+
+               for (int w = 0; w < nw; w++) {
+                    unsigned z = g[w] | (t[w] & ~x[w]);
+                    if (t[w] != o[w] || z != v[w]) {
+                         o[w] = t[w]; v[w] = z; changed = 1;
+                    }
+               }
+          }
+     } while (changed);
+}
+
+/* Each form of instruction has an encoder that takes the operands as
+   they are recorded, so that translation can call through a table
+   rather than switch on the form of every instruction */
+
+typedef void (*encoder)(operation op, ptr a, ptr b, ptr c, int s);
+
+static void enc1r(operation op, ptr a, ptr b, ptr c, int s) {
+     vm_enc1r(op, (vmreg) a);
+}
+
+static void enc1i(operation op, ptr a, ptr b, ptr c, int s) {
+     vm_enc1i(op, (int) a);
+}
+
+static void enc1a(operation op, ptr a, ptr b, ptr c, int s) {
+     vm_enc1a(op, (void *) a);
+}
+
+static void enc1j(operation op, ptr a, ptr b, ptr c, int s) {
+     vm_enc1j(op, (vmlabel) a);
+}
+
+static void enc2rr(operation op, ptr a, ptr b, ptr c, int s) {
+     vm_enc2rr(op, (vmreg) a, (vmreg) b);
+}
+
+static void enc2ri(operation op, ptr a, ptr b, ptr c, int s) {
+     vm_enc2ri(op, (vmreg) a, (int) b);
+}
+
+static void enc2rj(operation op, ptr a, ptr b, ptr c, int s) {
+     vm_enc2rj(op, (vmreg) a, (vmlabel) b);
+}
+
+static void enc3rrr(operation op, ptr a, ptr b, ptr c, int s) {
+     vm_enc3rrr(op, (vmreg) a, (vmreg) b, (vmreg) c);
+}
+
+static void enc3rri(operation op, ptr a, ptr b, ptr c, int s) {
+     vm_enc3rri(op, (vmreg) a, (vmreg) b, (int) c);
+}
+
+static void enc3rrj(operation op, ptr a, ptr b, ptr c, int s) {
+     vm_enc3rrj(op, (vmreg) a, (vmreg) b, (vmlabel) c);
+}
+
+static void enc3rij(operation op, ptr a, ptr b, ptr c, int s) {
+     vm_enc3rij(op, (vmreg) a, (int) b, (vmlabel) c);
+}
+
+static void enc4rrrs(operation op, ptr a, ptr b, ptr c, int s) {
+     vm_enc4rrrs(op, (vmreg) a, (vmreg) b, (vmreg) c, s);
+}
+
+static void enclabel(operation op, ptr a, ptr b, ptr c, int s) {
+     vm_place((vmlabel) a);
+}
+
+static void enccase(operation op, ptr a, ptr b, ptr c, int s) {
+     vm_branch(CASELAB, (code_addr) b, (vmlabel) a);
+}
+
+static void encsite(operation op, ptr a, ptr b, ptr c, int s) {
+     vm_encsite(op, (void *) a);
+}
+
+static const encoder encode[] = {
+     [IR_1R] = enc1r, [IR_1I] = enc1i, [IR_1A] = enc1a, [IR_1J] = enc1j,
+     [IR_2RR] = enc2rr, [IR_2RI] = enc2ri, [IR_2RJ] = enc2rj,
+     [IR_3RRR] = enc3rrr, [IR_3RRI] = enc3rri, [IR_3RRJ] = enc3rrj,
+     [IR_3RIJ] = enc3rij, [IR_4RRRS] = enc4rrrs,
+     [IR_LABEL] = enclabel, [IR_CASE] = enccase, [IR_SITE] = encsite
+};
+
+/* translate -- call the back end for each recorded instruction.  The
+   forms are all made in this file, so they need no checking. */
+static void translate(void) {
+     /* The back end cannot change the record, so keep the arrays in
+        registers across the calls */
+     int n = vm_ir.n;
+     unsigned char *ops = vm_ir.op, *form = vm_ir.form, *s = vm_ir.s;
+     ptr *ra = vm_ir.a, *rb = vm_ir.b, *rc = vm_ir.c;
+
+     for (int i = 0; i < n; i++)
+          (*encode[form[i]])((operation) ops[i], ra[i], rb[i], rc[i], s[i]);
+}
+
+/* vm_ir_begin -- start recording if translation is deferred, and
+   return whether it is.  The prelude is then made at vm_end, when the
+   size of the frame is known. */
+int vm_ir_begin(int n, int locs) {
+     vm_ir.n = 0; nsites = 0; nvregs = 0;
+     nargs = n; nlocs = locs;
+     deferring = vm_defer;
+     return deferring;
+}
+
+/* vm_ir_end -- translate the recorded instructions */
+void vm_ir_end(void) {
+     if (!deferring) return;
+     deferring = 0;
+     if (vm_fold) vm_fold_consts(nvregs);
+     if (vm_jumps) vm_thread_jumps();
+     if (vm_deadcode) vm_dead_code(nvregs);
+     if (vm_layout) vm_layout_blocks();
+     if (nvregs > 0) nlocs = vm_regalloc(nvregs, nlocs);
+     vm_prelude(nargs, nlocs);
+     translate();
+     vm_ir.n = 0;
+}
+
+/* vm_ir_drop -- discard the record after an error */
+void vm_ir_drop(void) {
+     deferring = 0;
+     vm_ir.n = 0;
+}
+
+/* release -- free the arrays of a record */
+static void release(struct ir *r) {
+     free(r->op); free(r->form); free(r->s);
+     free(r->a); free(r->b); free(r->c);
+     r->op = r->form = r->s = NULL;
+     r->a = r->b = r->c = NULL;
+     r->n = r->max = 0;
+}
+
+/* vm_free_ir -- give back the memory for the record */
+void vm_free_ir(void) {
+     release(&vm_ir);
+     release(&spare);
+}
@@ -0,0 +1,176 @@
+/*
+ * jumps.c
+ * 
+ * This file is part of the Oxford Oberon-2 compiler
+ * Copyright (c) 2006--2016 J. M. Spivey
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "vm.h"
+#include "vminternal.h"
+#include <string.h>
+
+/* Before translation, a label that is followed at once by a jump is
+   made an alias of the jump's target, so that branches to it go
+   straight to the final destination; then a conditional branch that
+   skips over a jump becomes one branch on the opposite condition, and
+   a jump or branch to the very next instruction is left out.  The
+   jumps that no longer have a label are left for vm_dead_code.  The
+   opposite of a floating point test is one of the BN forms, so that
+   comparisons with a NaN go the same way as before. */
+
+int vm_jumps = 1;               /* Whether to thread jumps */
+
+#define lab(x) ((vmlabel) (x))
+
+/* vm_negate -- the branch on the opposite condition */
+operation vm_negate(operation op) {
+     switch (op) {
+     case BEQ: return BNE;
+     case BNE: return BEQ;
+     case BLT: return BGE;
+     case BGE: return BLT;
+     case BLE: return BGT;
+     case BGT: return BLE;
+     case BLTu: return BGEu;
+     case BGEu: return BLTu;
+     case BLEu: return BGTu;
+     case BGTu: return BLEu;
+     case BEQq: return BNEq;
+     case BNEq: return BEQq;
+     case BLTq: return BGEq;
+     case BGEq: return BLTq;
+     case BLEq: return BGTq;
+     case BGTq: return BLEq;
+     case BEQf: return BNEf;
+     case BNEf: return BEQf;
+     case BLTf: return BNLTf;
+     case BNLTf: return BLTf;
+     case BLEf: return BNLEf;
+     case BNLEf: return BLEf;
+     case BGEf: return BNGEf;
+     case BNGEf: return BGEf;
+     case BGTf: return BNGTf;
+     case BNGTf: return BGTf;
+     case BEQd: return BNEd;
+     case BNEd: return BEQd;
+     case BLTd: return BNLTd;
+     case BNLTd: return BLTd;
+     case BLEd: return BNLEd;
+     case BNLEd: return BLEd;
+     case BGEd: return BNGEd;
+     case BNGEd: return BGEd;
+     case BGTd: return BNGTd;
+     case BNGTd: return BGTd;
+     default:
+          vm_panic("bad conditional branch");
+          return op;
+     }
+}
+
+static THREAD unsigned char *drop; /* Records that are left out */
+
+/* skip -- index of the first record from i that is kept */
+static int skip(int i) {
+     while (i < vm_ir.n && drop[i]) i++;
+     return i;
+}
+
+/* follows -- test if a label is placed just before record i */
+static int follows(int i, vmlabel lab) {
+     for (i = skip(i); i < vm_ir.n && vm_ir.form[i] == IR_LABEL;
+          i = skip(i+1)) {
+          if (lab(vm_ir.a[i]) == lab) return 1;
+     }
+     return 0;
+}
+
+/* vm_thread_jumps -- retarget branches that lead to jumps */
+void vm_thread_jumps(void) {
+     struct ir *r = &vm_ir;
+     int n = r->n, j;
+
+     drop = (unsigned char *) vm_scratch(n);
+     memset(drop, 0, n);
+
+     /* Labels just before a jump become aliases of its target, unless
+        the jump leads back to them */
+     for (int i = 0; i < n; i = j) {
+          for (j = i; j < n && r->form[j] == IR_LABEL; j++) ;
+          if (j == i) { j++; continue; }
+          if (j >= n || r->form[j] != IR_1J || r->op[j] != JUMP) continue;
+
+          for (int k = i; k < j; k++) {
+               vmlabel l = lab(r->a[k]);
+               if (vm_labroot(lab(r->a[j])) == l) continue;
+               vm_alias(l, lab(r->a[j]));
+               drop[k] = 1;
+          }
+     }
+
+     /* Send every reference to the final label */
+     for (int i = 0; i < n; i++) {
+          switch (r->form[i]) {
+          case IR_1J: case IR_CASE:
+               r->a[i] = (ptr) vm_labroot(lab(r->a[i])); break;
+          case IR_2RJ:
+               r->b[i] = (ptr) vm_labroot(lab(r->b[i])); break;
+          case IR_3RRJ: case IR_3RIJ:
+               r->c[i] = (ptr) vm_labroot(lab(r->c[i])); break;
+          }
+     }
+
+     /* Branches over a jump, and jumps to the next instruction */
+     for (int i = 0; i < n; i++) {
+          switch (r->form[i]) {
+          case IR_3RRJ: case IR_3RIJ:
+               j = skip(i+1);
+               if (j < n && r->form[j] == IR_1J && r->op[j] == JUMP
+                   && follows(j+1, lab(r->c[i]))) {
+                    r->op[i] = vm_negate(r->op[i]);
+                    r->c[i] = r->a[j];
+                    drop[j] = 1;
+               }
+               if (follows(i+1, lab(r->c[i]))) drop[i] = 1;
+               break;
+          case IR_1J:
+               if (r->op[i] == JUMP && !drop[i]
+                   && follows(i+1, lab(r->a[i]))) drop[i] = 1;
+               break;
+          }
+     }
+
+     /* Compact the record */
+     j = 0;
+     for (int i = 0; i < n; i++) {
+          if (drop[i]) continue;
+          r->op[j] = r->op[i]; r->form[j] = r->form[i];
+          r->s[j] = r->s[i];
+          r->a[j] = r->a[i]; r->b[j] = r->b[i]; r->c[j] = r->c[i];
+          j++;
+     }
+     r->n = j;
+}
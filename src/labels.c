@@ -34,49 +34,90 @@
 #include <stdio.h>
 #include <stdlib.h>
 
-/* There's a (little, we hope) pool of memory for recording branch
-   info, used by both us and the client.  Notes about forward branches
-   are recycled via a free-list, and the whole pool is made free
-   before translating each procedure.  To cope with really huge
-   procedures, there's a chain of pools of increasing size.  None of
-   this memory is ever returned. */
+/* There's a pool of memory for recording branch info, used by both
+   us and the client.  Notes about forward branches are recycled via a
+   free-list, and the whole pool is made free before translating each
+   procedure.  The pool is a list of chunks from vm_alloc, each twice
+   the size of the one before, so that really huge procedures can be
+   coped with; the chunks are used again for the next procedure, but
+   any beyond the first vm_scratch_keep bytes are given back then.  The
+   total is bounded by vm_scratch_limit. */
 
-#define NPOOLS 10
+int vm_scratch_limit = 64<<20;  /* Max bytes of scratch memory */
+int vm_scratch_keep = 64<<10;   /* Bytes kept between procedures */
 
-static unsigned char *pool[NPOOLS];
-static int cpool = -1;
+typedef struct _chunk *chunk;
+
+struct _chunk {
+     chunk c_next;              /* Next chunk in pool */
+     int c_size;                /* Size including this header */
+};
+
+#define HEADER ((sizeof(struct _chunk) + 7) & ~7)
+
+static THREAD chunk pool = NULL, cchunk = NULL; /* All chunks, current chunk */
+static THREAD unsigned char *freeptr, *limit;
 
 /* vm_scratch -- allocate memory for storing branch info, etc. */
 void *vm_scratch(int size) {
      void *p;
-     int poolsize;
-     static unsigned char *freeptr, *limit;
-
-     while (cpool < 0 || freeptr + size > limit) {
-	  cpool++;
-	  if (cpool >= NPOOLS) vm_panic("patch memory overflow");
-	  poolsize = (1 << cpool) * PAGESIZE;
-	  if (pool[cpool] == NULL)
-	       pool[cpool] = (unsigned char *) vm_alloc(poolsize);
-	  freeptr = pool[cpool]; limit = freeptr + poolsize;
+
+     size = (size + 7) & ~7;
+
+     while (cchunk == NULL || freeptr + size > limit) {
+          chunk next = (cchunk == NULL ? pool : cchunk->c_next);
+
+          if (next != NULL)
+               cchunk = next;
+          else {
+               int n = (cchunk == NULL ? PAGESIZE : 2 * cchunk->c_size);
+               while (n < size + HEADER) n *= 2;
+               if (vm_count.scratch_reserved + n > vm_scratch_limit)
+                    vm_fail("scratch memory limit exceeded");
+               chunk c = (chunk) vm_alloc(n);
+               if (c == NULL) vm_fail("out of scratch memory");
+               c->c_next = NULL; c->c_size = n;
+               if (cchunk == NULL) pool = c; else cchunk->c_next = c;
+               cchunk = c;
+               vm_count.scratch_reserved += n;
+          }
+
+          freeptr = (unsigned char *) cchunk + HEADER;
+          limit = (unsigned char *) cchunk + cchunk->c_size;
      }
 
      p = (void *) freeptr;
      freeptr += size;
+     vm_count.scratch_used += size;
+     vm_countscratch(size);
+     if (vm_count.scratch_used > vm_count.scratch_peak)
+          vm_count.scratch_peak = vm_count.scratch_used;
      return p;
 }
 
+/* trim -- give back chunks beyond the first keep bytes */
+static void trim(int keep) {
+     int n = 0;
+     chunk *cc = &pool;
+
+     while (*cc != NULL && n + (*cc)->c_size <= keep) {
+          n += (*cc)->c_size;
+          cc = &(*cc)->c_next;
+     }
+
+     while (*cc != NULL) {
+          chunk c = *cc;
+          *cc = c->c_next;
+          vm_count.scratch_reserved -= c->c_size;
+          vm_free(c, c->c_size);
+     }
+}
+
 /* Keep a table of branch targets, and deal with forward branches
    by backpatching when the target address is known.  */
 
 typedef struct _branch *branch;
 
-struct _vmlabel {
-     int l_serial;              /* Serial number */
-     code_addr l_val;           /* Native code address */
-     branch l_branches;
-};
-
 /* A (forward) branch waiting to be patched */
 struct _branch {
      int b_kind;		/* BRANCH or CASELAB */
@@ -84,7 +125,7 @@ struct _branch {
      branch b_next;		/* Next branch with same target */
 };
 
-static branch brfree;           /* Free list for branch records */
+static THREAD branch brfree;    /* Free list for branch records */
 
 /* bralloc -- allocate a branch record from the free list or pool */
 static branch bralloc(void) {
@@ -97,7 +138,8 @@ static branch bralloc(void) {
      return (branch) vm_scratch(sizeof(struct _branch));
 }
 
-static int nlabs = 0;
+static THREAD int nlabs = 0;
+static THREAD vmlabel labels = NULL; /* Labels made since vm_reset */
 
 /* vm_newlab -- allocate a label */
 vmlabel vm_newlab(void) {
@@ -105,27 +147,61 @@ vmlabel vm_newlab(void) {
      q->l_serial = ++nlabs;
      q->l_val = NULL;
      q->l_branches = NULL;
+     q->l_alias = NULL;
+     q->l_weight = -1;
+     q->l_next = labels;
+     labels = q;
      return q;
 }
 
+/* A label may be made an alias of another, and then stands for the
+   same place: branches to it are sent straight to the other label, and
+   it is never placed itself.  Chains of aliases are shortened as they
+   are followed. */
+
+/* vm_labroot -- the label that an alias finally stands for */
+vmlabel vm_labroot(vmlabel lab) {
+     vmlabel root = lab;
+
+     while (root->l_alias != NULL) root = root->l_alias;
+
+     while (lab != root) {
+          vmlabel next = lab->l_alias;
+          lab->l_alias = root;
+          lab = next;
+     }
+
+     return root;
+}
+
 #ifdef DEBUG
 char *fmt_lab(vmlabel lab) {
-     static char buf[16];
+     static THREAD char buf[16];
      sprintf(buf, "L%d", lab->l_serial);
      return buf;
 }
 #endif
 
-/* install -- patch in a branch target */
-static void install(int kind, code_addr loc, code_addr val) {
+/* vm_install -- patch in a branch target */
+void vm_install(int kind, code_addr loc, code_addr val) {
      switch (kind) {
      case BRANCH:
+     case JUMP32:
           vm_patch(loc, val);
           break;
+     case JUMP8: {
+          int d = val - xaddr(loc) - 1;
+          if (d < -128 || d > 127) vm_panic("short jump out of range");
+          * (signed char *) loc = d;
+          break;
+     }
      case ABS:
      case CASELAB:
           * (unsigned *) loc = (unsigned) (ptr) val;
           break;
+     case ABS64:
+          * (uint64 *) loc = (uint64) (ptr) val;
+          break;
      case HI16:
           * (unsigned *) loc =
                (* (unsigned *) loc & ~0xffff)
@@ -141,11 +217,52 @@ static void install(int kind, code_addr loc, code_addr val) {
      }
 }
 
-/* vm_label -- place a label */
-void vm_label(vmlabel lab) {
-     code_addr val = pc; 
+/* Every reference that is installed is also recorded with the
+   procedure, so that the code can be moved later and the references
+   fixed up. */
+
+/* note -- install a reference and record it */
+static void note(int kind, code_addr loc, code_addr val) {
+     vm_install(kind, loc, val);
+     vm_note(kind, loc, val);
+}
+
+/* vm_fixed -- install a reference to a known address */
+void vm_fixed(int kind, code_addr loc, code_addr val) {
+     note(kind, loc, val);
+}
+
+/* vm_relocate -- fix up after moving the current procedure from
+   [lo, hi) by delta */
+void vm_relocate(code_addr lo, code_addr hi, ptr delta) {
+     code_addr xlo = xaddr(lo), xhi = xaddr(hi);
+
+#define moved(p) ((code_addr) ((ptr) (p) + delta))
+
+     /* A label may be placed at hi, so the range is closed */
+     vm_remap(lo, hi+1, delta);
+
+     for (vmlabel q = labels; q != NULL; q = q->l_next) {
+          if (q->l_val >= xlo && q->l_val <= xhi)
+               q->l_val = moved(q->l_val);
+          for (branch b = q->l_branches; b != NULL; b = b->b_next) {
+               if (b->b_loc >= lo && b->b_loc < hi)
+                    b->b_loc = moved(b->b_loc);
+          }
+     }
+}
+
+THREAD code_addr vm_lastlab;     /* Where a label was last placed */
+
+/* vm_place -- place a label at the current location */
+void vm_place(vmlabel lab) {
+     code_addr val = xaddr(pc);
      branch q = NULL;
 
+     vm_lastlab = pc;
+
+     if (lab->l_alias != NULL) vm_panic("placing an alias label");
+
 #ifdef DEBUG
      if (vm_debug >= 1)
           printf("--- %s:\n", fmt_lab(lab));
@@ -155,7 +272,7 @@ void vm_label(vmlabel lab) {
 
      /* Backpatch any forward branches to this location */
      for (branch p = lab->l_branches; p != NULL; q = p, p = p->b_next)
-          install(p->b_kind, p->b_loc, val);
+          note(p->b_kind, p->b_loc, val);
 
      /* Put the branch records back on the free-list */
      if (q != NULL) {
@@ -167,8 +284,10 @@ void vm_label(vmlabel lab) {
 
 /* vm_branch -- note a branch for patching */
 void vm_branch(int kind, code_addr loc, vmlabel lab) {
+     lab = vm_labroot(lab);
+
      if (lab->l_val != NULL)
-          install(kind, loc, lab->l_val);
+          note(kind, loc, lab->l_val);
      else {
           branch br = bralloc();
           br->b_kind = kind;
@@ -178,25 +297,69 @@ void vm_branch(int kind, code_addr loc, vmlabel lab) {
      }
 }
 
+/* vm_alias -- make a label stand for the same place as another */
+void vm_alias(vmlabel lab, vmlabel other) {
+     vmlabel root = vm_labroot(other);
+     branch q = NULL;
+
+     if (lab->l_val != NULL || lab->l_alias != NULL)
+          vm_panic("alias for a placed label");
+     if (root == lab)
+          vm_panic("label made an alias of itself");
+
+     lab->l_alias = root;
+
+     /* Pass on any branches waiting for the label */
+     for (branch p = lab->l_branches; p != NULL; q = p, p = p->b_next) {
+          if (root->l_val != NULL)
+               note(p->b_kind, p->b_loc, root->l_val);
+     }
+
+     if (q != NULL) {
+          if (root->l_val != NULL) {
+               q->b_next = brfree;
+               brfree = lab->l_branches;
+          } else {
+               q->b_next = root->l_branches;
+               root->l_branches = lab->l_branches;
+          }
+          lab->l_branches = NULL;
+     }
+}
+
+/* vm_weight -- note how often the code at a label is run */
+void vm_weight(vmlabel lab, int count) {
+     lab->l_weight = count;
+}
+
 /* vm_reset -- discard branch information at end of procedure */
 void vm_reset(void) {
-     cpool = -1;
+     trim(vm_scratch_keep);
+     cchunk = NULL;
      brfree = NULL;
+     vm_countscratch(-vm_count.scratch_used);
+     vm_count.scratch_used = 0;
+     labels = NULL;
+}
+
+/* vm_free_scratch -- give back all scratch memory */
+void vm_free_scratch(void) {
+     vm_reset();
+     trim(0);
 }
 
 /* Jump tables */
 
-static unsigned *caseptr;
+static THREAD unsigned *caseptr;
 
 /* vm_jumptable -- begin a jump table */
 int vm_jumptable(int n) {
      code_addr table = vm_literal(n * sizeof(unsigned));
      caseptr = (unsigned *) table;
-     return vm_addr(table);
+     return vm_addr(raddr(table));
 }
 
-/* vm_caselab -- add an address to the current jump table */
-void vm_caselab(vmlabel lab) {
-     vm_branch(CASELAB, (code_addr) caseptr, lab);
-     caseptr++;
-}     
+/* vm_caseslot -- next entry in the current jump table */
+code_addr vm_caseslot(void) {
+     return (code_addr) caseptr++;
+}
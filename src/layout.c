@@ -0,0 +1,273 @@
+/*
+ * layout.c
+ * 
+ * This file is part of the Oxford Oberon-2 compiler
+ * Copyright (c) 2006--2016 J. M. Spivey
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "vm.h"
+#include "vminternal.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* If some labels in a procedure have been given counts by vm_weight,
+   the blocks are put in a new order before translation.  Each block
+   is given a frequency: the largest count of the labels that start
+   it, or if there are none, the largest frequency of a block that
+   leads to it, found by iterating to a fixed point.  The first block
+   and the targets of jump tables are taken to run as often as the most
+   frequent block.  An edge is as frequent as the less frequent of the
+   blocks it joins.  Working from the most frequent edge downwards,
+   blocks are joined into chains in which each block falls through to
+   the next, in the way of Pettis and Hansen; frequent blocks are not
+   chained with those that are seldom run (frequency 0).  The chains
+   are then laid out in the order in which they first appear in the
+   record, with the seldom-run ones last.  Where a block no longer
+   falls through to its old successor, a conditional branch is turned
+   round if its target comes next, and otherwise a jump is added;
+   jumps to the block that now comes next are left out.  Patchable
+   sites are numbered in order, so procedures that have them are left
+   alone. */
+
+int vm_layout = 1;              /* Whether to reorder blocks */
+
+#define lab(x) ((vmlabel) (x))
+
+#define NONE -2                 /* No fall-through */
+#define END -1                  /* Fall-through to the postlude */
+
+struct edge {
+     int e_freq;                /* Frequency */
+     int e_from, e_to;          /* Blocks joined */
+};
+
+static int cmpedge(const void *a, const void *b) {
+     const struct edge *x = (const struct edge *) a,
+          *y = (const struct edge *) b;
+     int fx = (x->e_to == x->e_from+1), fy = (y->e_to == y->e_from+1);
+
+     /* Most frequent first, then old fall-throughs, then in order */
+     if (x->e_freq != y->e_freq) return (x->e_freq > y->e_freq ? -1 : 1);
+     if (fx != fy) return fy - fx;
+     return x->e_from - y->e_from;
+}
+
+/* weight -- the largest count of the labels that start a block, or -1 */
+static int weight(int k) {
+     int w = -1;
+
+     for (int i = vm_block[k].first;
+          i <= vm_block[k].last && vm_ir.form[i] == IR_LABEL; i++) {
+          int c = vm_labroot(lab(vm_ir.a[i]))->l_weight;
+          if (c > w) w = c;
+     }
+
+     return w;
+}
+
+/* branches -- test if a block ends with a conditional branch */
+#define branches(k) \
+     (vm_ir.form[vm_block[k].last] == IR_3RRJ \
+      || vm_ir.form[vm_block[k].last] == IR_3RIJ)
+
+/* fallsto -- the block that block k falls through to, or END or NONE */
+static int fallsto(int k) {
+     int j = vm_block[k].last;
+
+     switch (vm_ir.form[j]) {
+     case IR_1J:
+          return NONE;
+     case IR_1R: case IR_SITE:
+          if (vm_ir.op[j] == JUMP) return NONE;
+          /* Fall through */
+     default:
+          return (k+1 < vm_nblock ? k+1 : END);
+     }
+}
+
+/* vm_layout_blocks -- put the blocks in order of frequency */
+void vm_layout_blocks(void) {
+     int n = vm_ir.n, nblock, nedge = 0, top = 0, hinted = 0, p, changed;
+     int *freq, *known, *next, *prev, *head, *tail, *order, *fix;
+     unsigned char *placed;
+     struct edge *edge;
+     vmlabel *first, endlab = NULL;
+     unsigned char *made;
+
+     /* Look for counts, and find the largest */
+     for (int i = 0; i < n; i++) {
+          if (vm_ir.form[i] == IR_SITE) return;
+          if (vm_ir.form[i] == IR_LABEL) {
+               int c = vm_labroot(lab(vm_ir.a[i]))->l_weight;
+               if (c > top) top = c;
+               if (c >= 0) hinted = 1;
+          }
+     }
+     if (!hinted) return;
+     if (top == 0) top = 1;
+
+     vm_ir_blocks();
+     nblock = vm_nblock;
+     if (nblock < 2) return;
+
+#define alloc(t, m) (t *) vm_scratch((m) * sizeof(t))
+     freq = alloc(int, nblock); known = alloc(int, nblock);
+     next = alloc(int, nblock); prev = alloc(int, nblock);
+     head = alloc(int, nblock); tail = alloc(int, nblock);
+     order = alloc(int, nblock); fix = alloc(int, nblock);
+     placed = alloc(unsigned char, nblock);
+     made = alloc(unsigned char, nblock);
+     first = alloc(vmlabel, nblock);
+     edge = alloc(struct edge, 2*nblock);
+
+     /* Frequency of each block */
+     for (int k = 0; k < nblock; k++) {
+          freq[k] = weight(k);
+          known[k] = (freq[k] >= 0);
+          if (!known[k]) freq[k] = 0;
+     }
+     if (!known[0]) freq[0] = top;
+     for (int s = 0; s < vm_ntaken; s++) {
+          int k = vm_taken[s];
+          if (!known[k]) freq[k] = top;
+     }
+
+     do {
+          changed = 0;
+          for (int k = 0; k < nblock; k++) {
+               for (int j = 0; j < 2; j++) {
+                    int s = vm_block[k].succ[j];
+                    if (s >= 0 && !known[s] && freq[s] < freq[k]) {
+                         freq[s] = freq[k]; changed = 1;
+                    }
+               }
+          }
+     } while (changed);
+
+     /* Join blocks into chains along the most frequent edges */
+     for (int k = 0; k < nblock; k++) {
+          for (int j = 0; j < 2; j++) {
+               int s = vm_block[k].succ[j];
+               if (s <= 0 || s == k || (freq[k] > 0) != (freq[s] > 0))
+                    continue;
+               edge[nedge].e_freq = (freq[k] < freq[s] ? freq[k] : freq[s]);
+               edge[nedge].e_from = k; edge[nedge].e_to = s;
+               nedge++;
+          }
+     }
+     qsort(edge, nedge, sizeof(struct edge), cmpedge);
+
+     for (int k = 0; k < nblock; k++) {
+          next[k] = prev[k] = -1;
+          head[k] = tail[k] = k;
+     }
+
+     for (int e = 0; e < nedge; e++) {
+          int b = edge[e].e_from, s = edge[e].e_to;
+          if (next[b] >= 0 || prev[s] >= 0 || head[b] == s) continue;
+          next[b] = s; prev[s] = b;
+          tail[head[b]] = tail[s];
+          head[tail[s]] = head[b];
+     }
+
+     /* Lay out the chains, starting with the one from the entry block
+        whatever its frequency, then frequent ones first */
+     memset(placed, 0, nblock);
+     p = 0;
+     for (int h = 0; h >= 0; h = next[h]) {
+          order[p++] = h; placed[h] = 1;
+     }
+     for (int pass = 0; pass < 2; pass++) {
+          for (int k = 0; k < nblock; k++) {
+               int h = k;
+               if (placed[k] || (freq[k] > 0) != (pass == 0)) continue;
+               while (prev[h] >= 0) h = prev[h];
+               for (; h >= 0; h = next[h]) {
+                    order[p++] = h; placed[h] = 1;
+               }
+          }
+     }
+
+     /* Find where jumps are needed, and make labels for them */
+     for (int k = 0; k < nblock; k++) {
+          int i = vm_block[k].first;
+          first[k] = (vm_ir.form[i] == IR_LABEL ? lab(vm_ir.a[i]) : NULL);
+          made[k] = 0;
+     }
+
+#define label(k) \
+     ((k) == END ? (endlab != NULL ? endlab : (endlab = vm_newlab())) \
+      : first[k] != NULL ? first[k] : (made[k] = 1, first[k] = vm_newlab()))
+
+     for (p = 0; p < nblock; p++) {
+          int k = order[p], after = (p+1 < nblock ? order[p+1] : END);
+          int to = fallsto(k);
+
+          fix[p] = NONE;
+          if (to == NONE || to == after) continue;
+          fix[p] = to;
+          (void) label(to);
+     }
+
+     /* Copy the blocks in their new order */
+     struct ir *t = vm_ir_copy();
+     for (p = 0; p < nblock; p++) {
+          int k = order[p], after = (p+1 < nblock ? order[p+1] : END);
+          struct irblock *bk = &vm_block[k];
+
+          if (made[k])
+               vm_ir_put(t, IR_LABEL, 0, (ptr) first[k], 0, 0, 0);
+
+          for (int i = bk->first; i <= bk->last; i++) {
+               operation op = vm_ir.op[i];
+               ptr c = vm_ir.c[i];
+
+               /* A jump to the next block is no longer needed */
+               if (i == bk->last && vm_ir.form[i] == IR_1J
+                   && bk->succ[0] == after)
+                    continue;
+
+               if (i == bk->last && fix[p] != NONE && branches(k)
+                   && after >= 0 && bk->succ[0] == after) {
+                    /* Turn the branch round, and fall into its target */
+                    op = vm_negate(op); c = (ptr) label(fix[p]);
+                    fix[p] = NONE;
+               }
+
+               vm_ir_put(t, vm_ir.form[i], op,
+                         vm_ir.a[i], vm_ir.b[i], c, vm_ir.s[i]);
+          }
+
+          if (fix[p] != NONE)
+               vm_ir_put(t, IR_1J, JUMP, (ptr) label(fix[p]), 0, 0, 0);
+     }
+
+     if (endlab != NULL)
+          vm_ir_put(t, IR_LABEL, 0, (ptr) endlab, 0, 0, 0);
+
+     vm_ir_swap();
+}
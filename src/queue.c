@@ -0,0 +1,305 @@
+/*
+ * queue.c
+ * 
+ * This file is part of the Oxford Oberon-2 compiler
+ * Copyright (c) 2006--2016 J. M. Spivey
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "config.h"
+#include "vm.h"
+#include "vminternal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* A procedure may be compiled in the background: the client submits a
+   function that compiles it, and at once gets an entry address for a
+   stub that jumps to the address held in a slot.  The slot first holds
+   the address of a fallback routine, and a worker thread stores the
+   address of the compiled code there when it is ready.  Since the stub
+   only jumps, the fallback is called with the same arguments that the
+   compiled code would receive.  Jobs wait in a queue ordered by
+   priority, then by order of submission. */
+
+#define QUEUED 0
+#define RUNNING 1
+#define DONE 2
+#define CANCELLED 3
+#define FAILED 4
+
+struct _vmjob {
+     void *(*j_fun)(void *);    /* Function that compiles the procedure */
+     void *j_arg;               /* Argument for it */
+     int j_prio;                /* Priority: higher goes first */
+     unsigned j_serial;         /* Order of submission */
+     int j_state;               /* QUEUED, RUNNING, ... */
+     code_addr j_slot;          /* Slot for stub, writable address */
+     void *j_stub;              /* Entry address of stub */
+     long j_start, j_latency;   /* Times of submission, to install */
+};
+
+/* now -- current time in microseconds */
+static long now(void) {
+     struct timespec t;
+     clock_gettime(CLOCK_MONOTONIC, &t);
+     return t.tv_sec * 1000000L + t.tv_nsec / 1000;
+}
+
+/* install -- point the stub at the compiled code */
+static void install(vmjob j, void *entry) {
+     if (entry == NULL) {
+          j->j_state = FAILED;
+          return;
+     }
+
+     vm_fillslot(j->j_slot, entry);
+     j->j_latency = now() - j->j_start;
+     j->j_state = DONE;
+}
+
+/* result -- the entry address of the compiled code, or NULL.  This
+   is read from the slot, where vm_compact updates it. */
+static void *result(vmjob j) {
+     if (j->j_state != DONE) return NULL;
+     return (void *) __atomic_load_n((ptr *) j->j_slot, __ATOMIC_ACQUIRE);
+}
+
+/* newjob -- make a job record and its stub */
+static vmjob newjob(void *(*fun)(void *), void *arg, funptr fallback,
+                    int prio) {
+     vmjob j = (vmjob) malloc(sizeof(struct _vmjob));
+     if (j == NULL) vm_panic("out of memory");
+     j->j_fun = fun; j->j_arg = arg; j->j_prio = prio;
+     j->j_state = QUEUED; j->j_latency = -1;
+     j->j_stub = vm_callthrough(&j->j_slot);
+     * (ptr *) j->j_slot = (ptr) fallback;
+     vm_protect();
+     j->j_start = now();
+     return j;
+}
+
+#ifdef HAVE_LIBPTHREAD
+
+static pthread_mutex_t qlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t qwork = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t qdone = PTHREAD_COND_INITIALIZER;
+
+static vmjob *queue;            /* Heap of waiting jobs */
+static int nqueue, maxqueue;
+static unsigned serial;
+
+static pthread_t *workers;
+static int nworkers;
+static int stopping;
+
+/* before -- test if job a should run before job b */
+static int before(vmjob a, vmjob b) {
+     if (a->j_prio != b->j_prio) return (a->j_prio > b->j_prio);
+     return ((int) (a->j_serial - b->j_serial) < 0);
+}
+
+/* siftup -- place job j at position i or above in the heap */
+static void siftup(int i, vmjob j) {
+     for (; i > 0 && before(j, queue[(i-1)/2]); i = (i-1)/2)
+          queue[i] = queue[(i-1)/2];
+     queue[i] = j;
+}
+
+/* siftdown -- place job j at position i or below in the heap */
+static void siftdown(int i, vmjob j) {
+     int k;
+
+     while ((k = 2*i+1) < nqueue) {
+          if (k+1 < nqueue && before(queue[k+1], queue[k])) k++;
+          if (!before(queue[k], j)) break;
+          queue[i] = queue[k]; i = k;
+     }
+     queue[i] = j;
+}
+
+/* push -- add a job to the heap */
+static void push(vmjob j) {
+     if (nqueue >= maxqueue) {
+          maxqueue = (maxqueue == 0 ? 64 : 2*maxqueue);
+          queue = (vmjob *) realloc(queue, maxqueue * sizeof(vmjob));
+          if (queue == NULL) vm_panic("out of memory");
+     }
+
+     siftup(nqueue++, j);
+}
+
+/* unqueue -- remove the job at position i from the heap */
+static vmjob unqueue(int i) {
+     vmjob j = queue[i], last = queue[--nqueue];
+
+     if (i < nqueue) {
+          siftdown(i, last);
+          siftup(i, queue[i]);
+     }
+     return j;
+}
+
+/* worker -- body of a worker thread */
+static void *worker(void *arg) {
+     pthread_mutex_lock(&qlock);
+     for (;;) {
+          while (nqueue == 0 && !stopping)
+               pthread_cond_wait(&qwork, &qlock);
+          if (nqueue == 0) break;
+
+          vmjob j = unqueue(0);
+          j->j_state = RUNNING;
+          pthread_mutex_unlock(&qlock);
+
+          void *entry = (*j->j_fun)(j->j_arg);
+
+          pthread_mutex_lock(&qlock);
+          install(j, entry);
+          pthread_cond_broadcast(&qdone);
+     }
+     pthread_mutex_unlock(&qlock);
+
+     vm_end_thread();
+     return NULL;
+}
+
+/* vm_start_workers -- start threads to compile submitted jobs */
+void vm_start_workers(int n) {
+     pthread_mutex_lock(&qlock);
+     if (nworkers > 0) vm_panic("workers are already running");
+     workers = (pthread_t *) malloc(n * sizeof(pthread_t));
+     if (workers == NULL) vm_panic("out of memory");
+     stopping = 0;
+     for (int i = 0; i < n; i++) {
+          if (pthread_create(&workers[i], NULL, worker, NULL) != 0)
+               vm_panic("cannot start worker thread");
+     }
+     nworkers = n;
+     pthread_mutex_unlock(&qlock);
+}
+
+/* vm_stop_workers -- finish all queued jobs and stop the workers */
+void vm_stop_workers(void) {
+     pthread_mutex_lock(&qlock);
+     stopping = 1;
+     pthread_cond_broadcast(&qwork);
+     pthread_mutex_unlock(&qlock);
+
+     for (int i = 0; i < nworkers; i++)
+          pthread_join(workers[i], NULL);
+
+     free(workers);
+     workers = NULL; nworkers = 0;
+}
+
+/* vm_submit -- queue a procedure to be compiled */
+vmjob vm_submit(void *(*fun)(void *), void *arg, funptr fallback, int prio) {
+     vmjob j = newjob(fun, arg, fallback, prio);
+
+     pthread_mutex_lock(&qlock);
+     if (nworkers == 0) {
+          /* Nobody to do it, so do it now */
+          pthread_mutex_unlock(&qlock);
+          j->j_state = RUNNING;
+          install(j, (*fun)(arg));
+          return j;
+     }
+
+     j->j_serial = serial++;
+     push(j);
+     pthread_cond_signal(&qwork);
+     pthread_mutex_unlock(&qlock);
+     return j;
+}
+
+/* vm_cancel -- withdraw a job that has not started */
+int vm_cancel(vmjob j) {
+     int ok;
+
+     pthread_mutex_lock(&qlock);
+     ok = (j->j_state == QUEUED);
+     if (ok) {
+          for (int i = 0; i < nqueue; i++) {
+               if (queue[i] == j) { unqueue(i); break; }
+          }
+          j->j_state = CANCELLED;
+          pthread_cond_broadcast(&qdone);
+     }
+     pthread_mutex_unlock(&qlock);
+     return ok;
+}
+
+/* vm_wait -- wait for a job to finish and return its entry address */
+void *vm_wait(vmjob j) {
+     pthread_mutex_lock(&qlock);
+     while (j->j_state == QUEUED || j->j_state == RUNNING)
+          pthread_cond_wait(&qdone, &qlock);
+     pthread_mutex_unlock(&qlock);
+     return result(j);
+}
+
+#else
+
+/* Without threads, each job is compiled when it is submitted */
+
+void vm_start_workers(int n) { }
+
+void vm_stop_workers(void) { }
+
+vmjob vm_submit(void *(*fun)(void *), void *arg, funptr fallback, int prio) {
+     vmjob j = newjob(fun, arg, fallback, prio);
+     j->j_state = RUNNING;
+     install(j, (*fun)(arg));
+     return j;
+}
+
+int vm_cancel(vmjob j) {
+     return 0;
+}
+
+void *vm_wait(vmjob j) {
+     return result(j);
+}
+
+#endif
+
+/* vm_job_entry -- the stable entry address for a job */
+void *vm_job_entry(vmjob j) {
+     return j->j_stub;
+}
+
+/* vm_job_latency -- microseconds from submission to install, or -1 */
+long vm_job_latency(vmjob j) {
+     return j->j_latency;
+}
+
+/* vm_free_job -- free the record of a finished or cancelled job; the
+   stub remains */
+void vm_free_job(vmjob j) {
+     vm_wait(j);
+     free(j);
+}
@@ -0,0 +1,456 @@
+/*
+ * regalloc.c
+ * 
+ * This file is part of the Oxford Oberon-2 compiler
+ * Copyright (c) 2006--2016 J. M. Spivey
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "vm.h"
+#include "vminternal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+/* Virtual registers are mapped onto physical ones by linear scan
+   [Poletto and Sarkar, 1999].  The liveness of each register is found
+   by the usual iteration over basic blocks, and widened to a single
+   interval of the record.  The intervals are taken in order of start
+   and each is given a free register if there is one; if not, whichever
+   ends last of it and the intervals holding a suitable register is
+   spilled, and lives in a frame slot throughout.  An instruction with
+   spilled operands finds them in scratch registers that are set aside
+   for the purpose, loaded before it and stored after it.
+
+   Points in the record are numbered so that instruction i uses its
+   operands at 2i and sets its result at 2i+1, so that the result may
+   share a register with an operand that dies there.  Physical
+   registers that the procedure names are given intervals too, and no
+   virtual register overlapping one of them may have that register. */
+
+#define MAXPOOL 32              /* Bound on allocatable registers */
+#define MAXSEQ 4                /* ARGs and CALL after a PREP */
+
+/* The registers that may be given out, caller-save first */
+static THREAD int npool;
+static THREAD vmreg pool[MAXPOOL];
+static THREAD unsigned char kind[MAXPOOL], callee[MAXPOOL];
+static THREAD unsigned char reserved[MAXPOOL];
+static THREAD signed char phys[NPHYS]; /* Pool index for each register */
+
+/* Scratch registers set aside for spilled operands */
+static THREAD int nscratch[2];
+static THREAD vmreg scratch[2][MAXSEQ];
+
+struct interval {
+     int start, end;            /* Extent in the record */
+     int reg;                   /* Pool index, or -1 if spilled */
+     int slot;                  /* Frame offset if spilled */
+     unsigned char kind;        /* VM_INT or VM_FLOAT */
+     unsigned char calls;       /* Whether it lives across a call */
+};
+
+/* Intervals for the virtual registers, then the pool registers */
+static THREAD int nreg, nvar;
+static THREAD struct interval *ival;
+
+static THREAD int ncall;
+static THREAD int *call;        /* Instructions that call, in order */
+
+/* Interval for each physical register, or -1 */
+static THREAD int pvar[NPHYS];
+
+/* var -- interval for a register, or -1 */
+static inline int var(vmreg r) {
+     return vm_irvar(r, pvar);
+}
+
+/* addpool -- add a register to the pool */
+static void addpool(vmreg r, int k, int save) {
+     if (npool >= MAXPOOL || r->vr_reg < 0 || r->vr_reg >= NPHYS)
+          vm_panic("bad register for allocation");
+     phys[r->vr_reg] = npool;
+     pool[npool] = r; kind[npool] = k; callee[npool] = save;
+     reserved[npool] = 0;
+     npool++;
+}
+
+/* makepool -- list the registers that may be given out */
+static void makepool(void) {
+     npool = 0;
+     memset(phys, -1, sizeof(phys));
+     for (int i = vm_nvreg; i < vm_nireg; i++)
+          addpool(vm_ireg[i], VM_INT, 0);
+     for (int i = 0; i < vm_nvreg; i++)
+          addpool(vm_ireg[i], VM_INT, 1);
+     for (int i = 0; i < vm_nfreg; i++)
+          addpool(vm_freg[i], VM_FLOAT, 0);
+     nscratch[VM_INT] = nscratch[VM_FLOAT] = 0;
+}
+
+/* Sets of intervals, as bit vectors of nwords words */
+static THREAD int nwords;
+
+/* extend -- widen an interval to include point p */
+static inline void extend(int v, int p) {
+     struct interval *iv = &ival[v];
+     if (p < iv->start) iv->start = p;
+     if (p > iv->end) iv->end = p;
+}
+
+/* liveness -- compute the intervals */
+static void liveness(int retvar) {
+     int n = vm_ir.n, nw = nwords, which[3], def[3];
+     unsigned size = vm_nblock * nw * sizeof(unsigned);
+     unsigned *in = (unsigned *) vm_scratch(size);
+     unsigned *out = (unsigned *) vm_scratch(size);
+     unsigned *t = (unsigned *) vm_scratch(nw * sizeof(unsigned));
+
+     memset(t, 0, nw * sizeof(unsigned));
+     if (retvar >= 0) setbit(t, retvar);
+     vm_ir_live(nw, pvar, retvar, t, NULL, in, out);
+
+     for (int v = 0; v < nvar; v++) {
+          ival[v].start = INT_MAX; ival[v].end = -1;
+          ival[v].reg = -1; ival[v].calls = 0;
+     }
+
+     /* A register is live from the start of each block where it is
+        live on entry, and to the end of each where it is live on exit */
+     for (int k = 0; k < vm_nblock; k++) {
+          unsigned *v = in + k*nw, *o = out + k*nw;
+          for (int w = 0; w < nw; w++) {
+               for (unsigned z = v[w]; z != 0; z &= z-1)
+                    extend(32*w + __builtin_ctz(z), 2*vm_block[k].first);
+               for (unsigned z = o[w]; z != 0; z &= z-1)
+                    extend(32*w + __builtin_ctz(z), 2*vm_block[k].last+1);
+          }
+     }
+
+     /* And at each place it is mentioned.  The argument of an ARG is
+        needed until the CALL, because the back end may move it into
+        place only then. */
+     call = (int *) vm_scratch(n * sizeof(int));
+     ncall = 0;
+     int next = -1;
+     for (int i = n-1; i >= 0; i--) {
+          int m = vm_operands(i, which, def), op = vm_ir.op[i];
+
+          if (iscall(vm_ir.form[i], op)) {
+               next = i; ncall++;
+               if (retvar >= 0) extend(retvar, 2*i+1);
+          }
+
+          for (int j = 0; j < m; j++) {
+               vmreg r = vm_rand(i, which[j]);
+               int v = var(r);
+               if (v < 0) continue;
+               if (v < nreg) ival[v].kind = r->vr_reg & 1;
+               if (def[j])
+                    extend(v, 2*i+1);
+               else
+                    extend(v, 2*(op == ARG && next >= 0 ? next : i));
+          }
+     }
+
+     for (int i = 0, k = 0; i < n; i++)
+          if (iscall(vm_ir.form[i], vm_ir.op[i])) call[k++] = i;
+
+     /* Note the intervals that live across a call */
+     for (int v = 0; v < nreg; v++) {
+          struct interval *iv = &ival[v];
+          int lo = 0, hi = ncall;
+          if (iv->end < 0) continue;
+          while (lo < hi) {
+               int mid = (lo+hi)/2;
+               if (2*call[mid] < iv->start) lo = mid+1; else hi = mid;
+          }
+          iv->calls = (lo < ncall && 2*call[lo]+2 <= iv->end);
+     }
+}
+
+/* fits -- test if pool register p would do for an interval */
+static inline int fits(int p, struct interval *iv) {
+     struct interval *fx = &ival[nreg+p];
+     return (kind[p] == iv->kind && !reserved[p]
+             && (callee[p] || !iv->calls)
+             && (fx->end < iv->start || iv->end < fx->start));
+}
+
+/* scan -- give registers to the intervals in order of start */
+static void scan(int *order, int norder) {
+     int active[MAXPOOL], nactive = 0;
+     int busy[MAXPOOL];
+
+     for (int p = 0; p < npool; p++) busy[p] = 0;
+
+     for (int k = 0; k < norder; k++) {
+          int v = order[k], m = 0, w = -1;
+          struct interval *iv = &ival[v];
+
+          /* Free the registers of intervals that have ended */
+          for (int j = 0; j < nactive; j++) {
+               int u = active[j];
+               if (ival[u].end < iv->start)
+                    busy[ival[u].reg] = 0;
+               else
+                    active[m++] = u;
+          }
+          nactive = m;
+
+          iv->reg = -1;
+          for (int p = 0; p < npool; p++) {
+               if (!busy[p] && fits(p, iv)) {
+                    iv->reg = p;
+                    busy[p] = 1;
+                    active[nactive++] = v;
+                    break;
+               }
+          }
+          if (iv->reg >= 0) continue;
+
+          /* Spill the interval that ends last */
+          for (int j = 0; j < nactive; j++) {
+               struct interval *u = &ival[active[j]];
+               if (fits(u->reg, iv) && (w < 0 || u->end > ival[active[w]].end))
+                    w = j;
+          }
+          if (w >= 0 && ival[active[w]].end > iv->end) {
+               struct interval *u = &ival[active[w]];
+               iv->reg = u->reg; u->reg = -1;
+               active[w] = v;
+          }
+     }
+}
+
+#define spilled(r) (isvirtual(r) && ival[var(r)].reg < 0)
+
+/* sequence -- find spilled operands of the ARG and CALL instructions
+   after a PREP; they are loaded before the PREP, which may move the
+   stack pointer */
+static int sequence(int i, int idx[]) {
+     int n = 0;
+
+     for (int j = i+1; j < vm_ir.n; j++) {
+          int f = vm_ir.form[j], op = vm_ir.op[j];
+          if (f == IR_1R && (op == ARG || op == CALL)) {
+               if (spilled((vmreg) vm_ir.a[j])) {
+                    if (n >= MAXSEQ) vm_panic("too many ARGs after PREP");
+                    idx[n++] = j;
+               }
+               if (op == CALL) break;
+          }
+          else if (!(f == IR_1I && op == ARG))
+               break;
+     }
+
+     return n;
+}
+
+/* needed -- count the scratch registers needed for spilled operands */
+static void needed(int need[]) {
+     int which[3], def[3], idx[MAXSEQ], end = -1;
+
+     need[VM_INT] = need[VM_FLOAT] = 0;
+
+     for (int i = 0; i < vm_ir.n; i++) {
+          if (vm_ir.form[i] == IR_1I && vm_ir.op[i] == PREP) {
+               int m = sequence(i, idx);
+               if (m > need[VM_INT]) need[VM_INT] = m;
+               if (m > 0) end = idx[m-1];
+               continue;
+          }
+          if (i <= end) continue;
+
+          /* Distinct spilled operands are loaded into different
+             registers, and the result goes in the first */
+          int m = vm_operands(i, which, def), uses[2] = { 0, 0 };
+          int defs[2] = { 0, 0 };
+          vmreg seen[3];
+          for (int j = 0; j < m; j++) {
+               vmreg r = seen[j] = vm_rand(i, which[j]);
+               int dup = 0;
+               if (!spilled(r)) continue;
+               if (def[j]) {
+                    defs[r->vr_reg & 1] = 1;
+                    continue;
+               }
+               for (int h = 0; h < j; h++)
+                    dup |= (!def[h] && seen[h] == r);
+               if (!dup) uses[r->vr_reg & 1]++;
+          }
+          for (int k = 0; k < 2; k++) {
+               int c = (uses[k] > defs[k] ? uses[k] : defs[k]);
+               if (c > need[k]) need[k] = c;
+          }
+     }
+}
+
+/* reserve -- set aside another scratch register that the procedure
+   does not name */
+static void reserve(int k) {
+     for (int p = 0; p < npool; p++) {
+          if (kind[p] == k && !reserved[p] && ival[nreg+p].end < 0) {
+               reserved[p] = 1;
+               scratch[k][nscratch[k]++] = pool[p];
+               return;
+          }
+     }
+
+     vm_fail("too few registers to spill");
+}
+
+/* spill -- add a load or store of a frame slot to the copy */
+static void spill(struct ir *t, operation op, vmreg s, int off) {
+#ifndef M64X32
+     /* Integer registers are one word, and there is no LDQ for them */
+     if (kind[phys[s->vr_reg]] == VM_INT)
+          op = (op == STQ ? STW : LDW);
+#endif
+     vm_ir_put(t, IR_3RRI, op, (ptr) s, (ptr) vm_base, off, 0);
+}
+
+/* rewrite -- copy the record with physical registers and spill code */
+static void rewrite(void) {
+     struct ir *t = vm_ir_copy();
+     int which[3], def[3], idx[MAXSEQ], nseq = 0;
+
+     for (int i = 0; i < vm_ir.n; i++) {
+          int form = vm_ir.form[i], op = vm_ir.op[i];
+          ptr f[3] = { vm_ir.a[i], vm_ir.b[i], vm_ir.c[i] };
+          vmreg loaded[3], into[3];
+          int nload = 0, count[2] = { 0, 0 };
+          vmreg save = NULL; int off = 0;
+
+          if (form == IR_1I && op == PREP) {
+               nseq = sequence(i, idx);
+               for (int h = 0; h < nseq; h++) {
+                    vmreg r = (vmreg) vm_ir.a[idx[h]];
+                    spill(t, LDQ, scratch[VM_INT][h], ival[var(r)].slot);
+               }
+          }
+
+          int m = vm_operands(i, which, def);
+          for (int j = 0; j < m; j++) {
+               vmreg r = (vmreg) f[which[j]], s = NULL;
+               if (!isvirtual(r)) continue;
+
+               struct interval *iv = &ival[var(r)];
+               if (iv->reg >= 0) {
+                    f[which[j]] = (ptr) pool[iv->reg];
+                    continue;
+               }
+
+               for (int h = 0; h < nseq; h++)
+                    if (idx[h] == i) s = scratch[VM_INT][h];
+               for (int h = 0; h < nload && s == NULL; h++)
+                    if (loaded[h] == r) s = into[h];
+
+               if (s == NULL) {
+                    int k = iv->kind;
+                    s = scratch[k][def[j] ? 0 : count[k]++];
+                    if (!def[j]) {
+                         spill(t, LDQ, s, iv->slot);
+                         loaded[nload] = r; into[nload++] = s;
+                    }
+               }
+
+               if (def[j]) { save = s; off = iv->slot; }
+               f[which[j]] = (ptr) s;
+          }
+
+          vm_ir_put(t, form, op, f[0], f[1], f[2], vm_ir.s[i]);
+          if (save != NULL) spill(t, STQ, save, off);
+     }
+
+     vm_ir_swap();
+}
+
+static int cmpkey(const void *a, const void *b) {
+     int64 x = * (const int64 *) a, y = * (const int64 *) b;
+     return (x < y ? -1 : x > y ? 1 : 0);
+}
+
+/* vm_regalloc -- replace the virtual registers in the record */
+int vm_regalloc(int nr, int locs) {
+     int n = vm_ir.n, which[3], def[3], need[2], norder = 0;
+
+     makepool();
+     nreg = nr; nvar = nreg + npool;
+     for (int k = 0; k < NPHYS; k++)
+          pvar[k] = (phys[k] >= 0 ? nreg + phys[k] : -1);
+     nwords = (nvar + 31) / 32;
+     ival = (struct interval *) vm_scratch(nvar * sizeof(struct interval));
+     if (n == 0) return locs;
+
+     /* The result register is live where the procedure names it */
+     int retvar = -1;
+     for (int i = 0; i < n && retvar < 0; i++) {
+          int m = vm_operands(i, which, def);
+          for (int j = 0; j < m; j++)
+               if (vm_rand(i, which[j])->vr_reg == vm_ret->vr_reg)
+                    retvar = var(vm_ret);
+     }
+
+     vm_ir_blocks();
+     liveness(retvar);
+
+     /* Sort the intervals by start */
+     int64 *key = (int64 *) vm_scratch(nreg * sizeof(int64));
+     int *order = (int *) vm_scratch(nreg * sizeof(int));
+     for (int v = 0; v < nreg; v++)
+          if (ival[v].end >= 0)
+               key[norder++] = ((int64) ival[v].start << 32) | v;
+     qsort(key, norder, sizeof(int64), cmpkey);
+     for (int k = 0; k < norder; k++) order[k] = (int) key[k];
+
+     /* Set aside scratch registers until there are enough */
+     for (;;) {
+          scan(order, norder);
+          needed(need);
+          if (need[VM_INT] <= nscratch[VM_INT]
+              && need[VM_FLOAT] <= nscratch[VM_FLOAT])
+               break;
+          for (int k = 0; k < 2; k++)
+               while (nscratch[k] < need[k]) reserve(k);
+     }
+
+     /* Share the frame slots among spilled intervals that do not meet */
+     int base = (locs + 7) & ~7, nslot = 0;
+     int *slotend = (int *) vm_scratch(norder * sizeof(int) + 1);
+     for (int k = 0; k < norder; k++) {
+          struct interval *iv = &ival[order[k]];
+          int s = 0;
+          if (iv->reg >= 0) continue;
+          while (s < nslot && slotend[s] >= iv->start) s++;
+          if (s == nslot) nslot++;
+          slotend[s] = iv->end;
+          iv->slot = base + 8*s;
+     }
+
+     rewrite();
+     return (nslot > 0 ? base + 8*nslot : locs);
+}
@@ -214,6 +214,17 @@ typedef struct _vmlabel *vmlabel;
 vmlabel vm_newlab(void);
 void vm_label(vmlabel lab);
 
+/* vm_alias -- make lab stand for the same place as other, which may be
+   placed before or after; lab itself must not be placed */
+void vm_alias(vmlabel lab, vmlabel other);
+
+/* vm_weight -- give the number of times the code at a label is
+   expected to run, from a profile or a guess; a count of 0 marks code
+   such as an error path that is seldom run.  The counts are used only
+   by vm_layout, and only their relative sizes matter. */
+void vm_weight(vmlabel lab, int count);
+#define vm_cold(lab) vm_weight(lab, 0)
+
 void vm_gen0(operation op);
 void vm_gen1r(operation op, vmreg a);
 void vm_gen1i(operation op, int a);
@@ -244,15 +255,318 @@ typedef void (*funptr)(void);
 
 int vm_wrap(funptr fun);
 
+/* vm_literal_align -- allocate writable data space apart from the
+   code, with the given alignment */
 void *vm_literal_align(int n, int almt);
 #define vm_literal(n) vm_literal_align(n, 4);
 
 /* vm_procsize -- size of last procedure */
 int vm_procsize(void);
 
+/* Size of the blocks in which code is allocated, initially CODEPAGE.
+   It may be changed at any time, but on ARM literal pools must stay
+   in reach of the code, so it should not exceed 4096 there. */
+extern int vm_codepage;
+
+/* If vm_contiguous is set, a procedure that overflows its block is
+   moved to a bigger one, rather than continuing elsewhere after a
+   jump.  Every procedure is then contiguous.  The entry address
+   returned by vm_begin is kept as a jump to the moved code, so calls
+   to a moved procedure pass through that jump; vm_procsize includes
+   it, and the statistics count it as a chain.  On the ARM, the
+   literals made so far are first put in line with a branch around
+   them, so that they move with the code. */
+extern int vm_contiguous;
+
+/* If vm_defer is set when vm_begin is called, the instructions of the
+   procedure are recorded as they are generated and translated all
+   together at vm_end, so that they can be improved first.  Labels are
+   then given addresses only at vm_end, and vm_procsize means nothing
+   until then.  The passes vm_fold, vm_jumps, vm_deadcode and vm_layout
+   below are all set initially, as are vm_peephole and vm_relax in the
+   back end; to defer translation without improving the code, clear
+   the first four. */
+extern int vm_defer;
+
+/* Virtual registers: after vm_begin in a procedure compiled with
+   vm_defer, vm_newreg gives a fresh register of the given kind, as
+   many as are wanted, for use like any of vm_ireg or vm_freg.  At vm_end they
+   are mapped onto physical registers by linear scan.  A value that
+   lives across a CALL is given a callee-save register, others prefer
+   the caller-save ones, and any that do not fit are kept in slots that
+   are added to the frame after the locals.  Physical registers that
+   the procedure names itself, including vm_ret, are not used where
+   they hold a value, so the two kinds may be mixed. */
+#define VM_INT 0
+#define VM_FLOAT 1
+
+vmreg vm_newreg(int kind);
+
+/* If vm_fold is set, as it is initially, constants are propagated
+   through procedures compiled with vm_defer before translation:
+   registers known to hold constants become immediate operands,
+   arithmetic on constants is done at once, and branches with a known
+   outcome become jumps or are left out. */
+extern int vm_fold;
+
+/* If vm_jumps is set, as it is initially, branches in procedures
+   compiled with vm_defer that lead to a label followed by a jump are sent
+   straight to the final destination, a conditional branch over a jump
+   becomes a single branch on the opposite condition, and jumps to the
+   very next instruction are left out. */
+extern int vm_jumps;
+
+/* If vm_deadcode is set, as it is initially, procedures compiled with
+   vm_defer lose blocks that cannot be reached and instructions whose
+   results are never used. */
+extern int vm_deadcode;
+
+/* If vm_layout is set, as it is initially, the blocks of a procedure
+   compiled with vm_defer in which labels have been given counts with
+   vm_weight are put in a new order.  A block without a count is taken
+   to run as often as the most frequent block that leads to it.  Blocks
+   are chained so that each falls through to its most frequent
+   successor where it can, and those that are seldom run go to the end
+   of the procedure.  The first block stays first. */
+extern int vm_layout;
+
+/* If vm_peephole is set, as it is initially, the x86 back end leaves
+   out moves, loads and tests that the instruction just before makes
+   unnecessary.  The bytes saved are counted in the statistics. */
+extern int vm_peephole;
+
+/* If vm_relax is set, as it is initially, the x86 back end shortens
+   jumps and branches to labels that an 8-bit displacement will reach
+   when each procedure is finished, and closes up the code.  Procedures
+   with patchable sites, or that continue in another block of code,
+   keep the long forms. */
+extern int vm_relax;
+
+/* vm_compact -- move procedures together to free fragmented memory.
+   References between procedures and from jump tables are fixed up,
+   and so are the slots behind job stubs (see vm_submit), which are
+   recorded as references from the procedure installed in them.  The
+   callback, if not NULL, is told the old and new entry address of
+   each procedure that moves; any other copies of entry addresses that
+   the client keeps are its own business.  This must not be called
+   while any compiled code is active, since return addresses would
+   point into the old copies, nor while jobs are being compiled.
+   Returns the number of procedures moved. */
+int vm_compact(void (*moved)(void *old, void *new));
+
+/* vm_batch_begin -- start a batch of procedures.  Procedures compiled
+   in a batch are not ready to run until the matching vm_batch_commit,
+   which protects pages and flushes caches for all of them at once.
+   Batches may be nested, and only the outermost commit counts. */
+void vm_batch_begin(void);
+
+/* vm_batch_commit -- finish a batch of procedures */
+void vm_batch_commit(void);
+
+/* vm_free_proc -- release the memory used by a procedure, given its
+   entry address.  Literals, jump tables and trampolines that were made
+   while the procedure was being compiled go with it; those made
+   outside any procedure are never freed. */
+void vm_free_proc(void *entry);
+
+/* Code spaces: each procedure belongs to the code space that was
+   current when it was compiled, and so do the literals, jump tables
+   and trampolines made with it.  Freeing a space gives back all its
+   memory at once, without freeing procedures one by one. */
+typedef struct _codespace *vm_codespace;
+
+/* vm_new_codespace -- create an empty code space */
+vm_codespace vm_new_codespace(void);
+
+/* vm_set_codespace -- choose the space for procedures compiled from
+   now on; NULL means the first space, which always exists.  Memory
+   statistics and vm_compact also apply to the current space. */
+void vm_set_codespace(vm_codespace s);
+
+/* vm_free_codespace -- destroy a space and all that is in it.  Its
+   procedures must not be called again. */
+void vm_free_codespace(vm_codespace s);
+
+/* Code caches: a cache is a file of code that several processes map
+   at the same address, with an index of procedures under keys that
+   the client chooses, so that a procedure compiled by one process can
+   be used by all.  The code may refer to functions and data by
+   address, so the processes must be alike, for example forked from
+   one parent after it has opened the cache.  Procedures in a cache
+   are never freed or moved. */
+typedef struct _vmcache *vm_cache;
+
+/* vm_cache_open -- map a cache file, making one of the given size if
+   there is none; returns NULL if the file cannot be mapped at the
+   same address as in other processes, or if it is not a plain file
+   that belongs to the user and only the user may write */
+vm_cache vm_cache_open(const char *path, int size);
+
+/* vm_cache_space -- the code space for compiling into a cache */
+vm_codespace vm_cache_space(vm_cache c);
+
+/* vm_cache_find -- find a procedure in the index, or return NULL.
+   This never waits for other processes. */
+void *vm_cache_find(vm_cache c, const void *key, int len);
+
+/* vm_cache_publish -- enter a procedure compiled in the cache space
+   in the index, once it is ready to run; returns the entry address
+   that is now in the index, which is another process's if it got
+   there first.  If the index or the space for keys is full, it
+   returns NULL, and the procedure can still be called at its own
+   entry but is not shared. */
+void *vm_cache_publish(vm_cache c, const void *key, int len, void *entry);
+
+/* Several threads may compile at once, each with its own compiler
+   state and code buffers, sharing only the memory allocator; each
+   procedure must be compiled from start to finish by one thread.
+   vm_end_thread gives back the memory that a thread holds for
+   compiling, and should be called before it exits. */
+void vm_end_thread(void);
+
+/* Background compilation: vm_submit queues a function that compiles a
+   procedure with vm_begin ... vm_end and returns its entry address,
+   or NULL if it fails.  vm_job_entry gives an entry address that may
+   be called at once: it runs the fallback routine with the same
+   arguments until the procedure has been compiled, and then runs the
+   compiled code.  Jobs of higher priority are compiled first. */
+typedef struct _vmjob *vmjob;
+
+/* vm_start_workers -- start n threads to compile jobs; until this is
+   called, each job is compiled when it is submitted */
+void vm_start_workers(int n);
+
+/* vm_stop_workers -- compile any jobs that are queued, then stop */
+void vm_stop_workers(void);
+
+/* vm_submit -- queue a job for compilation */
+vmjob vm_submit(void *(*compile)(void *arg), void *arg,
+                funptr fallback, int prio);
+
+/* vm_job_entry -- the stable entry address for a job */
+void *vm_job_entry(vmjob j);
+
+/* vm_cancel -- withdraw a job that has not started; returns 0 if it
+   is too late */
+int vm_cancel(vmjob j);
+
+/* vm_wait -- wait for a job to finish or be cancelled, and return the
+   entry address of the compiled code, or NULL */
+void *vm_wait(vmjob j);
+
+/* vm_job_latency -- microseconds from submission until the compiled
+   code was installed, or -1 if it has not been */
+long vm_job_latency(vmjob j);
+
+/* vm_free_job -- wait for a job, then free its record; the stub
+   remains in use */
+void vm_free_job(vmjob j);
+
+/* Patchable sites: vm_site compiles a CALL or JUMP to a fixed address,
+   like vm_gen1a, but so that vm_retarget can change the address later
+   while other threads are running the code.  It returns a number for
+   the site, counting from 0 in each procedure.  A procedure with
+   sites is never moved by vm_compact.  On ARM, the target must always
+   be within 32MB of the site. */
+int vm_site(operation op, void *target);
+
+/* vm_retarget -- change the target of a site in a procedure, given
+   its entry address */
+void vm_retarget(void *entry, int site, void *target);
+
+/* If vm_patch_sync is set, vm_retarget does not return until every
+   thread is sure to see the new target, using membarrier where the
+   system has it.  Otherwise a thread may run the old target once or
+   twice more. */
+extern int vm_patch_sync;
+
+/* vm_arena -- set the size of the code arena, which has separate
+   writable and executable views.  Call before compiling anything;
+   size 0 means use pages from vm_alloc that are both writable and
+   executable.  With flag VM_HUGE, the arena is aligned and backed by
+   huge pages if possible.  When the arena is full, another of the
+   same size is added.  Returns 0 if no arena could be made, in which
+   case those pages are used anyway. */
+int vm_arena(int size, int flags);
+
+#define VM_HUGE 1
+
+/* Memory statistics, in bytes.  The code and data figures are for
+   the current code space.  For the first space, the reserved space is
+   the whole of the arenas if there are any, and otherwise what vm_alloc has
+   provided and not been given back; other spaces reserve memory in
+   blocks taken from the first.  Literals, trampolines and chains are
+   counted for the procedures that have not been freed, and for
+   literals and trampolines made outside any procedure; the savings
+   from vm_peephole and vm_relax are totals over every procedure
+   compiled.  Parts of the blocks that each thread carves its memory
+   from count as reserved but not used until they are carved, and
+   again once they are freed.  The
+   scratch memory used is the total for all threads at the time. */
+struct vm_stats {
+     int code_reserved, code_used, code_peak; /* Code and trampolines */
+     int data_reserved, data_used, data_peak; /* Literals, jump tables */
+     int literal_bytes;         /* Literals, wherever they are kept */
+     int stub_bytes;            /* Trampolines */
+     int scratch_reserved, scratch_used, scratch_peak; /* Branch info */
+     int nprocs;                /* Procedures not freed */
+     int chains;                /* Jumps from one code block to another */
+     int proc_peak;             /* Size of largest procedure */
+     int lock_waits;            /* Times a thread waited for the allocator */
+     int peephole_bytes;        /* Code bytes saved by vm_peephole */
+     int relax_bytes;           /* Code bytes saved by vm_relax */
+};
+
+/* vm_stats -- fill in statistics for all memory */
+void vm_stats(struct vm_stats *s);
+
+/* Statistics for a single procedure */
+struct vm_procstats {
+     int code;                  /* Code space, with in-line literals */
+     int data;                  /* Space apart from the code */
+     int literal_bytes;         /* Literals and jump tables */
+     int stub_bytes;            /* Trampolines */
+     int chains;                /* Jumps from one code block to another */
+     int peephole_bytes;        /* Code bytes saved by vm_peephole */
+     int relax_bytes;           /* Code bytes saved by vm_relax */
+};
+
+/* vm_procstats -- fill in statistics for the procedure with a given
+   entry address, or return 0 if there is none */
+int vm_procstats(void *entry, struct vm_procstats *s);
+
+/* Information about the procedure that contains a code address */
+struct vm_procinfo {
+     const char *name;          /* Name given to vm_begin */
+     void *entry;               /* Entry address */
+     void *start, *end;         /* Piece of code containing the address */
+};
+
+/* vm_lookup_pc -- find the procedure containing an address, or return
+   0 if there is none.  It takes no locks and allocates no memory, so
+   it may be called from a signal handler.  A procedure that continues
+   in another block of memory is in several pieces; the name stays
+   valid until the procedure is freed. */
+int vm_lookup_pc(void *addr, struct vm_procinfo *info);
+
+/* Limits on the memory used for labels and branch records: the most
+   that may be used, and the most that is kept between procedures */
+extern int vm_scratch_limit, vm_scratch_keep;
+
+/* If vm_onerror is not NULL, then it is called after an error such as
+   running out of memory, once the procedure being compiled has been
+   abandoned; it should not return, but may longjmp to a place where
+   the client can carry on and compile other procedures.  Labels made
+   for the abandoned procedure must not be used again.  Otherwise,
+   such errors are fatal. */
+extern void (*vm_onerror)(const char *msg);
+
 /* Callback to allocate pages of memory */
 void *vm_alloc(int size);
 
+/* Callback to give back pages allocated by vm_alloc */
+void vm_free(void *p, int size);
+
 /* Level of debug printing, if compiled for debugging */
 extern int vm_debug;
 
@@ -180,7 +180,7 @@ static char *_regname[] = {
 static char **regname = &_regname[1];
 
 static char *fmt_addr(int rb, int imm, int rx, int s) {
-     static char buf[32], sbuf[16];
+     static THREAD char buf[32], sbuf[16];
 
      if (rb == NOREG && rx == NOREG)
           sprintf(buf, "%s", fmt_val(imm));
@@ -397,6 +397,7 @@ static char *fmt_addr(int rb, int imm, int rx, int s) {
 #define opPUSH_i	MNEM("push", 0x68)
 #define opPOP		MNEM("pop", 0x58)
 #define opRET		MNEM("ret", 0xc3)
+#define opNOP		MNEM("nop", 0x90)
 #define opJMP		MNEM2("jmp", 0xff, 4)
 #define opJMP_i		MNEM("jmp", 0xe9)
 #define opCALL		MNEM2("call", 0xff, 2)
@@ -459,7 +460,7 @@ static char *fmt_addr(int rb, int imm, int rx, int s) {
 
 /* Instruction formats */
 
-code_addr ibeg;
+THREAD code_addr ibeg;
 
 /* opcode -- one, two or three opcode bytes */
 static void opcode(unsigned op) {
@@ -573,7 +574,9 @@ static void memory(int ra, int rb, int d, int rx, int s) {
 	  modrm(0, ra, 5), word(d);
 #else
           // Use PC-relative addressing
-          modrm(0, ra, 5), word((code_addr) (address) d - pc - 4);
+          code_addr r;
+          modrm(0, ra, 5), r = pc, word(0);
+          vm_fixed(BRANCH, r, (code_addr) (address) d);
           // Was: modrm(0, ra, 4), sib(0, 4, 5), word(d);
 #endif
      } else if (rb == rSP && rx == NOREG) {
@@ -583,8 +586,9 @@ static void memory(int ra, int rb, int d, int rx, int s) {
 	  else if (signed8(d))
 	       modrm(1, ra, 4), sib(0, 4, rSP), byte(d); // {H}, untested
 	  else
-	       SXTOFF, modrm(2, ra, 4),
-                    sib(0, 4, rSP), word(d); // {K}, untested
+               // The stack may be above 4GB, but offsets in the
+               // frame are positive, so no addr32 prefix
+	       modrm(2, ra, 4), sib(0, 4, rSP), word(d); // {K}
      } else if (rx == NOREG) {
 	  // Base + Displacement [rb+d]
 	  if (d == 0 && rb != rBP)
@@ -728,16 +732,51 @@ static void instr_tgt(OPDECL, code_addr tgt) {
      vm_debug2("%s %s", mnem, fmt_val((unsigned) (address) tgt));
      assert(tgt != NULL);
      opcode(op), r = pc, word(0);
-     vm_patch(r, tgt);
+     vm_fixed(BRANCH, r, tgt);
      vm_done();
 }
 
+/* A patchable site keeps its target in a field that is aligned, so
+   that a single store can change it while other threads are running
+   the code; an aligned field never crosses a cache line. */
+
+/* align_field -- pad with nops so that a field off bytes into the
+   next instruction is aligned to n */
+static void align_field(int off, int n) {
+     while (((ptr) pc + off) & (n-1))
+          instr(opNOP);
+}
+
+#ifndef M64X32
+/* site_tgt -- opcode plus patchable branch target */
+static int site_tgt(OPDECL, code_addr tgt) {
+     code_addr r;
+     align_field(1, 4);
+     vm_debug2("%s %s", mnem, fmt_val((unsigned) (address) tgt));
+     opcode(op), r = pc, word(0);
+     vm_install(BRANCH, r, tgt);
+     vm_done();
+     return vm_notesite(BRANCH, r, tgt);
+}
+#else
+/* site_ind -- indirect jump or call via a patchable pointer that
+   follows the instruction */
+static int site_ind(OPDECL2, code_addr tgt) {
+     code_addr r;
+     align_field(6, 8);
+     vm_debug2("%s *%s", mnem, fmt_val64((uint64) (address) tgt));
+     opcode(op), modrm(0, op2, 5), word(0), r = pc, qword((uint64) tgt);
+     vm_done();
+     return vm_notesite(ABS64, r, tgt);
+}
+#endif
+
 /* instr_lab -- opcode plus label */
 static void instr_lab(OPDECL, vmlabel lab) {
      code_addr r;
      vm_debug2("%s %s", mnem, fmt_lab(lab));
      opcode(op), r = pc, word(0);
-     vm_branch(BRANCH, r, lab);
+     vm_branch(JUMP32, r, lab);
      vm_done();
 }
 
@@ -815,12 +854,87 @@ static void shift2_i(OPDECL, int rd, int imm) {
 	  instr2_ri8(MNEM2(mnem, xSHIFT_i, op), rd, imm);
 }
 
+/* PEEPHOLE OPTIMISATION
+
+   Because VM instructions have three operands and x86 instructions
+   two, and because clients keep values in locals, the instructions
+   we emit are often redundant given the one just before.  As some
+   instructions are emitted, we remember a fact that holds just after
+   them: that two registers are equal, that a register was just stored
+   at an address, or that the flags reflect the value of a register.
+   The next instruction may use the fact, but only if it follows
+   immediately with no label in between, so that no other path can
+   reach it.  Bytes saved are counted for vm_stats and vm_procstats. */
+
+#define P_MOVE 1                /* Register r equals register r2 */
+#define P_STORE 2               /* Register r was stored at an address */
+#define P_FLAGS 3               /* Flags are as after test r, r */
+#define P_SETCC 4               /* r = 1 if condition cc holds, else 0 */
+
+static THREAD struct {
+     int kind;                  /* P_MOVE, etc., or 0 */
+     code_addr end;             /* Location just after the instruction */
+     int r, r2;                 /* Registers */
+     int wide;                  /* Whether 64 bits were moved or stored */
+     int rb, d, rx, s;          /* Address stored into */
+     int len;                   /* Length of the store */
+     int cc;                    /* Condition code for P_SETCC */
+} fact;
+
+/* remember -- record a fact about the instruction just emitted */
+#define remember(k) fact.kind = k, fact.end = pc
+
+/* known -- test whether a fact holds here */
+static int known(int kind) {
+     return (vm_peephole && fact.kind == kind
+             && fact.end == pc && vm_lastlab != pc);
+}
+
+/* saved -- count bytes that need not be emitted */
+static void saved(int n) {
+     vm_count.peephole_bytes += n;
+}
+
+#ifdef M64X32
+#define rexbit(r) ((r) != NOREG && isrex(r))
+#else
+#define rexbit(r) 0
+#endif
+
+/* rr_size -- length of an instruction with two register operands */
+static int rr_size(OPDECL, int r1, int r2) {
+     int n = 1;
+     for (unsigned x = op; x != 0; x >>= 8) n++;
+     if ((rexbit(r1) || rexbit(r2)) && (op & 0xf0) != REX) n++;
+     return n;
+}
+
+#ifdef DEBUG
+static const char *jname[] = {
+     "jo", "jno", "jb", "jae", "je", "jne", "jbe", "ja",
+     "js", "jns", "jp", "jnp", "jl", "jge", "jle", "jg"
+};
+#endif
+
 /* SYNTHETIC INSTRUCTIONS */
 
 /* Optional move */
 static void move_r(OPDECL, int rd, int rs) {
-     if (rd != rs) 
+     int wide = ((op & 0xff) == REX_W);
+
+     /* After mov t, a, move from a instead of t; but a 32-bit move
+        does not give all of t for a 64-bit one */
+     if (rd != rs && known(P_MOVE) && rs == fact.r
+         && (fact.wide || !wide)) {
+          rs = fact.r2;
+          if (rd == rs) saved(rr_size(OP, rd, fact.r));
+     }
+
+     if (rd != rs) {
           instr_rr(OP, rd, rs);
+          fact.r = rd; fact.r2 = rs; fact.wide = wide;
+          remember(P_MOVE);
+     }
 }
 
 #define move(rd, rs)    move_r(opMOVL_r, rd, rs)
@@ -899,6 +1013,16 @@ static void gmonop(OPDECL2, OPDECL_(move), int rd, int rs) {
 #define neg64(rd, rs) \
      gmonop(MONOP64(opNEG), REXW_(opMOVL_r), rd, rs)
 
+/* setflags -- note that the flags reflect a register, after a 32-bit
+   ALU operation */
+static void setflags(int r) {
+     fact.r = r;
+     remember(P_FLAGS);
+}
+
+/* 32-bit add, or, and, sub and xor, but not cmp or imul */
+#define isalu(op) (((op) & ~0x38) == 0x03 && (op) != 0x3b)
+
 /* commutative ALU operation (3 register operands) */
 static void gcommute(OPDECL, OPDECL_(move), int rd, int rs1, int rs2) {
      if (rd == rs2)
@@ -907,6 +1031,8 @@ static void gcommute(OPDECL, OPDECL_(move), int rd, int rs1, int rs2) {
 	  move_r(OP_(move), rd, rs1);
 	  instr_rr(OP, rd, rs2);
      }
+
+     if (isalu(op)) setflags(rd);
 }
 
 #define commute(op, rd, rs1, rs2) \
@@ -924,6 +1050,8 @@ static void gsubtract(OPDECL, OPDECL2_(neg), OPDECL_(move),
 	  move_r(OP_(move), rd, rs1);
 	  instr_rr(OP, rd, rs2);
      }
+
+     if (isalu(op)) setflags(rd);
 }
 
 #define subtract(rd, rs1, rs2) \
@@ -933,7 +1061,7 @@ static void gsubtract(OPDECL, OPDECL2_(neg), OPDECL_(move),
 
 /* binary ALU operation, 2 registers + immediate */
 #define binop3_i(op, rd, rs, imm) \
-     move(rd, rs), instr2_ri(op, rd, imm)
+     move(rd, rs), instr2_ri(op, rd, imm), setflags(rd)
 
 /* Conditional branch, 2 registers */
 #define branch_r(op, rs1, rs2, lab) \
@@ -962,6 +1090,8 @@ static void gcomp_i(OPDECL2_(cmp), OPDECL_(test), int rs, int imm) {
      comp64_i(rs, imm), instr_lab(op, lab)
 
 static void setcc_r(OPDECL2, int rd) {
+     int cc = (op >> 8) & 0xf;
+
      if (is8bit(rd)) {
 	  instr2_r(OP2, rd); /* Compute boolean result */
           instr_rr(opMOVZBL_r, rd, rd); /* Zero-extend */
@@ -976,6 +1106,29 @@ static void setcc_r(OPDECL2, int rd) {
 	  pop(rAX);
 #endif
      }
+
+     /* Neither movzx nor pop changes the flags */
+     fact.r = rd; fact.cc = cc;
+     remember(P_SETCC);
+}
+
+/* branch_zero -- try to branch on a register being zero or not
+   without testing it, when the flags already tell */
+static int branch_zero(operation op, int r, vmlabel lab) {
+     int cc, neg = (op == BEQ);
+
+     if (known(P_SETCC) && fact.r == r)
+          /* The register is 1 exactly when the flags give fact.cc */
+          cc = fact.cc ^ neg;
+     else if (known(P_FLAGS) && fact.r == r)
+          /* ZF is set exactly when the register is zero */
+          cc = (neg ? 4 : 5);
+     else
+          return 0;
+
+     saved(rr_size(opTEST, r, r));
+     instr_lab(MNEM(jname[cc], pfx(0x0f, 0x80|cc)), lab);
+     return 1;
 }
 
 /* setcc_equal -- boolean result if equal and not NaN */
@@ -984,7 +1137,7 @@ void setcc_equal(int r) {
      setcc_r(SETCC(opE), r);
      instr_lab(CONDJ(opNP), lab1);
      move_i(r, 0);
-     vm_label(lab1);
+     vm_place(lab1);
 }
 
 /* jump_equal -- jump if equal and not NaN */
@@ -992,7 +1145,7 @@ void jump_equal(vmlabel lab) {
      vmlabel lab1 = vm_newlab();
      instr_lab(CONDJ(opP), lab1);
      instr_lab(CONDJ(opE), lab);
-     vm_label(lab1);
+     vm_place(lab1);
 }
 
 /* setcc_not_equal -- boolean result if not equal or NaN */
@@ -1001,7 +1154,7 @@ void setcc_not_equal(int r) {
      setcc_r(SETCC(opNE), r);
      instr_lab(CONDJ(opNP), lab1);
      inc_r(r);
-     vm_label(lab1);
+     vm_place(lab1);
 }
 
 /* jump_not_equal -- jump if not equal or NaN */
@@ -1030,39 +1183,39 @@ void jump_not_equal(vmlabel lab) {
 
 #define fmove_s(rd, rs)  move_r(opMOVSS_r, rd, rs)
 #define fmove_d(rd, rs)  move_r(opMOVSD_r, rd, rs)
+
+/* Sign masks for negation: literals belong to the procedure that made
+   them, so they are made afresh for each procedure */
+static THREAD code_addr negmask_s, negmask_d;
      
 static void fneg_s(int rd, int rs) {
-     static code_addr mask;
-
      static unsigned proto[4] = {
           0x80000000, 0, 0, 0
      };
 
-     if (mask == NULL) {
+     if (negmask_s == NULL) {
           unsigned *p = (unsigned *) vm_literal_align(16, 16);
           memcpy(p, proto, 16);
-          mask = (code_addr) p;
+          negmask_s = raddr(p);
      }
 
      fmove_s(rd, rs);
-     instr_rm(opXORPS, rd, NOREG, (int) (ptr) mask, NOREG, 0);
+     instr_rm(opXORPS, rd, NOREG, (int) (ptr) negmask_s, NOREG, 0);
 }
 
 static void fneg_d(int rd, int rs) {
-     static code_addr mask;
-
      static unsigned proto[4] = {
           0, 0x80000000, 0, 0
      };
 
-     if (mask == NULL) {
+     if (negmask_d == NULL) {
           unsigned *p = (unsigned *) vm_literal_align(16, 16);
           memcpy(p, proto, 16);
-          mask = (code_addr) p;
+          negmask_d = raddr(p);
      }
 
      fmove_d(rd, rs);
-     instr_rm(opXORPD, rd, NOREG, (int) (ptr) mask, NOREG, 0);
+     instr_rm(opXORPD, rd, NOREG, (int) (ptr) negmask_d, NOREG, 0);
 }
 
 static void flop3(OPDECL, OPDECL_(move), int rd, int rs1, int rs2) {
@@ -1256,8 +1409,8 @@ static void fcomp_d(int rs1, int rs2) {
 
 /* STACK FRAMES */
 
-static int locals;             /* Size of local space */
-static int nargs;              /* Effective number of outgoing args */
+static THREAD int locals;      /* Size of local space */
+static THREAD int nargs;       /* Effective number of outgoing args */
 
 #ifndef M64X32
 
@@ -1311,6 +1464,10 @@ static void call_a(void *a) {
 
 void *vm_prelude(int n, int locs) {
      code_addr entry = pc;
+     fact.kind = 0;
+#ifdef USE_SSE
+     negmask_s = negmask_d = NULL;
+#endif
      locals = (locs+3)&~3;
      push_r(rBP); push_r(rBX); push_r(rSI); push_r(rDI); 
      if (locals > 0) sub_i(rSP, locals);
@@ -1363,12 +1520,12 @@ sp:	outgoing shadow area
 Outgoing arguments are passed in rCX, rDX, r8.
 */
 
-static int inargs;
+static THREAD int inargs;
 
-static int argnum;              /* Last argument pushed */
-static int argreg[3];   	/* Whether each arg is a register */
-static int argval[3];           /* Value for each arg, or reg  */
-static int funreg;              /* Register containing function address */
+static THREAD int argnum;       /* Last argument pushed */
+static THREAD int argreg[3];    /* Whether each arg is a register */
+static THREAD int argval[3];    /* Value for each arg, or reg  */
+static THREAD int funreg;       /* Register containing function address */
 
 static void prep_call(int n) {
      nargs = n; argnum = n; funreg = NOREG;
@@ -1461,11 +1618,16 @@ static void call_r(int ra) {
 static void call_a(void *a) {
      move_args();
      move_i64(rAX, (uint64) a);
+     vm_fixed(ABS64, pc-8, (code_addr) a);
      instr2_r(opCALL, rAX);
 }     
 
 void *vm_prelude(int n, int locs) {
      code_addr entry = pc;
+     fact.kind = 0;
+#ifdef USE_SSE
+     negmask_s = negmask_d = NULL;
+#endif
      inargs = n;
      push_r(rBP); push_r(rBX); push_r(r15); push_r(r14);
 #ifdef WINDOWS     
@@ -1507,7 +1669,7 @@ static void retn(void) {
 
 #define badop() vm_unknown(__FUNCTION__, op)
 
-void vm_gen1r(operation op, vmreg rega) {
+void vm_enc1r(operation op, vmreg rega) {
      int ra = rega->vr_reg;
 
      vm_debug1(op, 1, rega->vr_name);     
@@ -1539,7 +1701,7 @@ void vm_gen1r(operation op, vmreg rega) {
      }
 }
 
-void vm_gen1a(operation op, void *a) {
+void vm_enc1a(operation op, void *a) {
      vm_debug1(op, 1, fmt_ptr(a));
      vm_space(0);
 
@@ -1553,7 +1715,7 @@ void vm_gen1a(operation op, void *a) {
      }
 }
 
-void vm_gen1i(operation op, int a) {
+void vm_enc1i(operation op, int a) {
      vm_debug1(op, 1, fmt_val(a));
      vm_space(0);
 
@@ -1571,7 +1733,7 @@ void vm_gen1i(operation op, int a) {
      }
 }
 
-void vm_gen1j(operation op, vmlabel lab) {
+void vm_enc1j(operation op, vmlabel lab) {
      vm_debug1(op, 1, fmt_lab(lab));     
      vm_space(0);
 
@@ -1587,7 +1749,7 @@ void vm_gen1j(operation op, vmlabel lab) {
 
 static void vm_load_store(operation op, int ra, int rb, int c, int rx, int s);
 
-void vm_gen2rr(operation op, vmreg rega, vmreg regb) {
+void vm_enc2rr(operation op, vmreg rega, vmreg regb) {
      int ra = rega->vr_reg, rb = regb->vr_reg;
 
      vm_debug1(op, 2, rega->vr_name, regb->vr_name);
@@ -1683,7 +1845,7 @@ void vm_gen2rr(operation op, vmreg rega, vmreg regb) {
      }
 }
 
-void vm_gen2ri(operation op, vmreg rega, int b) {
+void vm_enc2ri(operation op, vmreg rega, int b) {
      int ra = rega->vr_reg;
 
      vm_debug1(op, 2, rega->vr_name, fmt_val(b));
@@ -1713,7 +1875,7 @@ void vm_gen2ri(operation op, vmreg rega, int b) {
      }
 }
 
-void vm_gen2rj(operation op, vmreg rega, vmlabel b) {
+void vm_enc2rj(operation op, vmreg rega, vmlabel b) {
      int ra = rega->vr_reg;
      
      vm_debug1(op, 2, rega->vr_name, fmt_lab(b));
@@ -1733,7 +1895,7 @@ void vm_gen2rj(operation op, vmreg rega, vmlabel b) {
      }
 }
 
-void vm_gen3rrr(operation op, vmreg rega, vmreg regb, vmreg regc) {
+void vm_enc3rrr(operation op, vmreg rega, vmreg regb, vmreg regc) {
      int ra = rega->vr_reg, rb = regb->vr_reg, rc = regc->vr_reg;
 
      vm_debug1(op, 3, rega->vr_name, regb->vr_name, regc->vr_name);
@@ -1871,7 +2033,7 @@ void vm_gen3rrr(operation op, vmreg rega, vmreg regb, vmreg regc) {
      }
 }
 
-void vm_gen4rrrs(operation op, vmreg rega, vmreg regb, vmreg regc, int s) {
+void vm_enc4rrrs(operation op, vmreg rega, vmreg regb, vmreg regc, int s) {
      int ra = rega->vr_reg, rb = regb->vr_reg, rc = regc->vr_reg;
 
      vm_debug1(op, 4, rega->vr_name, regb->vr_name, regc->vr_name, fmt_val(s));
@@ -1887,13 +2049,46 @@ void vm_gen4rrrs(operation op, vmreg rega, vmreg regb, vmreg regc, int s) {
      }
 }
 
+/* stored -- note that an integer register has been stored */
+static void stored(int rt, int rb, int d, int rx, int s, int wide) {
+     fact.r = rt; fact.wide = wide;
+     fact.rb = rb; fact.d = d; fact.rx = rx; fact.s = s;
+     fact.len = pc - ibeg;
+     remember(P_STORE);
+}
+
+/* forward -- replace a load from the address just stored into by a
+   move from the register that was stored */
+static int forward(int rd, int rb, int d, int rx, int s, int wide) {
+     if (!known(P_STORE) || fact.wide != wide || fact.rb != rb
+         || fact.d != d || fact.rx != rx || fact.s != s)
+          return 0;
+
+     /* The load is as long as the store, except for the REX prefix */
+     int rt = fact.r, x = (wide || rexbit(rb) || rexbit(rx));
+     int n = fact.len - (x || rexbit(rt)) + (x || rexbit(rd));
+
+     if (rd != rt) {
+          if (wide) {
+               n -= rr_size(REXW_(opMOVL_r), rd, rt);
+               move64(rd, rt);
+          } else {
+               n -= rr_size(opMOVL_r, rd, rt);
+               move(rd, rt);
+          }
+     }
+
+     saved(n);
+     return 1;
+}
+
 static void vm_load_store(operation op, int ra,
                            int rb, int c, int rx, int s) {
      switch(op) {
      case LDW:
 	  if (isfloat(ra)) 
                fload_s(ra, rb, c, rx, s);
-          else 
+          else if (!forward(ra, rb, c, rx, s, 0))
                instr_rm(opMOVL_r, ra, rb, c, rx, s);
 	  break;
      case LDSu: 
@@ -1907,8 +2102,10 @@ static void vm_load_store(operation op, int ra,
      case STW: 
 	  if (isfloat(ra)) 
                fstore_s(ra, rb, c, rx, s); 
-          else 
+          else {
                instr_st(opMOVL_m, ra, rb, c, rx, s);
+               stored(ra, rb, c, rx, s, 0);
+          }
 	  break;
      case STS: 
           instr_st(opMOVW_m, ra, rb, c, rx, s); break;
@@ -1928,14 +2125,16 @@ static void vm_load_store(operation op, int ra,
      case LDQ: 
           if (isfloat(ra))
                fload_d(ra, rb, c, rx, s);
-          else
+          else if (!forward(ra, rb, c, rx, s, 1))
                instr_rm(REXW_(opMOVL_r), ra, rb, c, rx, s);
           break;
      case STQ:    
           if (isfloat(ra))
                fstore_d(ra, rb, c, rx, s);
-          else
+          else {
                instr_st(REXW_(opMOVL_m), ra, rb, c, rx, s);
+               stored(ra, rb, c, rx, s, 1);
+          }
           break;
 #endif
 
@@ -1944,7 +2143,7 @@ static void vm_load_store(operation op, int ra,
      }
 }
 
-void vm_gen3rri(operation op, vmreg rega, vmreg regb, int c) {
+void vm_enc3rri(operation op, vmreg rega, vmreg regb, int c) {
      int ra = rega->vr_reg, rb = regb->vr_reg;
 
      vm_debug1(op, 3, rega->vr_name, regb->vr_name, fmt_val(c));
@@ -1957,6 +2156,7 @@ void vm_gen3rri(operation op, vmreg rega, vmreg regb, int c) {
                inc_r(ra);
           else
                instr2_ri(ALUOP_i(opADD), ra, c);
+          setflags(ra);
           break;
 
      case SUB: 
@@ -1965,6 +2165,7 @@ void vm_gen3rri(operation op, vmreg rega, vmreg regb, int c) {
                dec_r(ra);
           else
                instr2_ri(ALUOP_i(opSUB), ra, c);
+          setflags(ra);
           break;
 
 #ifdef M64X32
@@ -2041,7 +2242,7 @@ void vm_gen3rri(operation op, vmreg rega, vmreg regb, int c) {
      }
 }
 
-void vm_gen3rrj(operation op, vmreg rega, vmreg regb, vmlabel lab) {
+void vm_enc3rrj(operation op, vmreg rega, vmreg regb, vmlabel lab) {
      int ra = rega->vr_reg, rb = regb->vr_reg;
 
      vm_debug1(op, 3, rega->vr_name, regb->vr_name, fmt_lab(lab));
@@ -2166,12 +2367,15 @@ BNGE    T       F       F       T       JB
      }
 }
 
-void vm_gen3rij(operation op, vmreg rega, int b, vmlabel lab) {
+void vm_enc3rij(operation op, vmreg rega, int b, vmlabel lab) {
      int ra = rega->vr_reg;
 
      vm_debug1(op, 3, rega->vr_name, fmt_val(b), fmt_lab(lab));
      vm_space(0);
 
+     if (b == 0 && (op == BEQ || op == BNE) && branch_zero(op, ra, lab))
+          return;
+
      switch (op) {
      case BEQ: 
 	  branch_i(CONDJ(opE), ra, b, lab); break;
@@ -2214,14 +2418,221 @@ void vm_gen3rij(operation op, vmreg rega, int b, vmlabel lab) {
      }
 }
 
+/* vm_encsite -- CALL or JUMP to an address that can be changed later */
+int vm_encsite(operation op, void *a) {
+     vm_debug1(op, 1, fmt_ptr(a));
+     vm_space(0);
+
+     switch (op) {
+#ifndef M64X32
+     case CALL: {
+          int n = site_tgt(opCALL_i, (code_addr) a);
+          post_call();
+          return n;
+     }
+
+     case JUMP:
+          return site_tgt(opJMP_i, (code_addr) a);
+#else
+     case CALL: {
+          code_addr r;
+          move_args();
+          align_field(2, 8);
+          move_i64(rAX, (uint64) a);
+          r = pc-8;
+          instr2_r(opCALL, rAX);
+          return vm_notesite(ABS64, r, (code_addr) a);
+     }
+
+     case JUMP:
+          return site_ind(opJMP, (code_addr) a);
+#endif
+
+     default:
+	  badop();
+          return -1;
+     }
+}
+
 void vm_patch(code_addr loc, code_addr lab) {
      int *p = ((int *) loc);
-     *p = lab - loc - 4;
+     *p = lab - xaddr(loc) - 4;
+}
+
+/* vm_repatch -- change a reference in code that may be running */
+void vm_repatch(int kind, code_addr loc, code_addr val) {
+     switch (kind) {
+     case BRANCH:
+          assert(((ptr) loc & 3) == 0);
+          __atomic_store_n((int *) loc, (int) (val - xaddr(loc) - 4),
+                           __ATOMIC_RELEASE);
+          break;
+#ifdef M64X32
+     case ABS64:
+          assert(((ptr) loc & 7) == 0);
+          __atomic_store_n((uint64 *) loc, (uint64) (ptr) val,
+                           __ATOMIC_RELEASE);
+          break;
+#endif
+     default:
+          vm_panic("bad patch kind");
+     }
+}
+
+/* Jumps to labels are assembled with 32-bit displacements, because
+   the target of a forward jump is not known at the time.  When the
+   procedure is finished, vm_shorten gives the 2-byte form to each jump
+   that can reach its target with an 8-bit displacement, and closes up
+   the code.  All the jumps are first assumed to be short, and any that
+   cannot then reach are made long again, until nothing changes; since
+   making a jump long only moves targets further away, this ends.
+   Every reference in the procedure was recorded by vm_note, so the
+   rest of the code can be fixed up from the records.  Patchable sites
+   must stay aligned, so procedures that have them are left alone. */
+
+struct jump {
+     code_addr j_loc;           /* Displacement of the long form */
+     code_addr j_tgt;           /* Target, as a writable address */
+     int j_len;                 /* Length of the long opcode */
+     int j_op;                  /* Opcode of the short form */
+     int j_save;                /* Bytes saved if short, or 0 */
+     reloc *j_rel;              /* Record of the reference */
+};
+
+static THREAD int njump;
+static THREAD struct jump *jump;
+static THREAD int *cum;         /* Bytes saved by jumps 0..k */
+
+/* saving -- bytes saved before writable address p */
+static int saving(code_addr p) {
+     int a = 0, b = njump;
+
+     /* Invariant: jumps [0..a) end at or before p, and [b..) after it */
+     while (a < b) {
+          int k = (a+b)/2;
+          if (jump[k].j_loc + 4 <= p)
+               a = k+1;
+          else
+               b = k;
+     }
+
+     return (a == 0 ? 0 : cum[a-1]);
+}
+
+/* cmpjump -- compare jumps by location for qsort */
+static int cmpjump(const void *a, const void *b) {
+     const struct jump *j1 = a, *j2 = b;
+     return (j1->j_loc < j2->j_loc ? -1 : j1->j_loc > j2->j_loc ? 1 : 0);
+}
+
+/* vm_shorten -- shorten jumps in [beg, end) and return the new end */
+code_addr vm_shorten(code_addr beg, code_addr end, code_addr entry) {
+     int nrel, changed;
+     reloc *rel = vm_relocs(&nrel);
+     code_addr from = entry - vm_xoff, p, q;
+
+     if (from < beg || from > end) from = beg;
+
+     njump = 0;
+     jump = (struct jump *) vm_scratch(nrel * sizeof(struct jump));
+     for (int i = 0; i < nrel; i++) {
+          reloc *r = &rel[i];
+          code_addr loc = r->r_loc, tgt = r->r_val - vm_xoff;
+          if (r->r_kind & SITE) return end;
+          if (r->r_kind != JUMP32 || loc < from+2 || loc+4 > end
+              || tgt < from || tgt > end) continue;
+
+          struct jump *j = &jump[njump];
+          if (loc[-1] == 0xe9)
+               j->j_len = 1, j->j_op = 0xeb, j->j_save = 3;
+          else if (loc[-2] == 0x0f && (loc[-1] & 0xf0) == 0x80)
+               j->j_len = 2, j->j_op = 0x70 | (loc[-1] & 0xf), j->j_save = 4;
+          else
+               continue;
+          j->j_loc = loc; j->j_tgt = tgt; j->j_rel = r;
+          njump++;
+     }
+
+     if (njump == 0) return end;
+     qsort(jump, njump, sizeof(struct jump), cmpjump);
+     cum = (int *) vm_scratch(njump * sizeof(int));
+
+     do {
+          changed = 0;
+          for (int k = 0, t = 0; k < njump; k++)
+               cum[k] = t += jump[k].j_save;
+
+          for (int k = 0; k < njump; k++) {
+               struct jump *j = &jump[k];
+               if (j->j_save == 0) continue;
+               int d = (j->j_tgt - saving(j->j_tgt))
+                    - (j->j_loc + 4 - cum[k]);
+               if (d < -128 || d > 127) {
+                    j->j_save = 0; changed = 1;
+               }
+          }
+     } while (changed);
+
+     if (cum[njump-1] == 0) return end;
+
+     /* Close up the code, leaving the displacements to be installed */
+     p = q = beg;
+     for (int k = 0; k < njump; k++) {
+          struct jump *j = &jump[k];
+          code_addr op = j->j_loc - j->j_len;
+          memmove(p, q, op - q); p += op - q;
+          if (j->j_save > 0) {
+               *p = j->j_op; p += 2;
+          } else {
+               memmove(p, op, j->j_len + 4);
+               p += j->j_len + 4;
+          }
+          q = j->j_loc + 4;
+     }
+     memmove(p, q, end - q); p += end - q;
+
+     /* Move the references, then install them all again */
+     for (int i = 0; i < nrel; i++) {
+          reloc *r = &rel[i];
+          code_addr v = r->r_val - vm_xoff;
+          if (r->r_loc >= beg && r->r_loc < end)
+               r->r_loc -= saving(r->r_loc);
+          if (v >= beg && v <= end)
+               r->r_val -= saving(v);
+     }
+     for (int k = 0; k < njump; k++) {
+          struct jump *j = &jump[k];
+          if (j->j_save > 0) {
+               j->j_rel->r_kind = JUMP8;
+               j->j_rel->r_loc -= j->j_len - 1;
+          }
+     }
+     for (int i = 0; i < nrel; i++)
+          vm_install(rel[i].r_kind & ~SITE, rel[i].r_loc, rel[i].r_val);
+
+#ifdef DEBUG
+     /* The listing shows the code before shortening: give the new
+        address of each jump that was shortened, since everything
+        after it up to the next one moves back by the same amount */
+     if (vm_debug >= 1) {
+          printf("--- shortened %d bytes\n", (int) (end - p));
+          for (int k = 0; vm_debug >= 2 && !vm_aflag && k < njump; k++) {
+               struct jump *j = &jump[k];
+               code_addr op = j->j_loc - j->j_len;
+               if (j->j_save == 0) continue;
+               printf("---   %#x -> %#x\n", (unsigned) (ptr) xaddr(op),
+                      (unsigned) (ptr) xaddr(op - saving(op)));
+          }
+     }
+#endif
+
+     vm_count.relax_bytes += end - p;
+     return p;
 }
 
 #ifdef M64X32
 int vm_tramp(funptr f) {
-     code_addr p = vm_literal(12);
+     code_addr p = vm_stub(12);
      code_addr q = p;
 
      // mov ax, #addr64
@@ -2230,10 +2641,29 @@ int vm_tramp(funptr f) {
      // jmp ax
      *q++ = 0xff; *q++ = 0xe0;
 
-     return (int) (ptr) p;
+     return (int) (ptr) xaddr(p);
 }
 #endif
 
+/* vm_callthrough -- make a stub that jumps via a slot.  The slot is
+   in data memory, so that storing a new target in it does not write
+   near code that other threads are running. */
+code_addr vm_callthrough(code_addr *slot) {
+     code_addr s = vm_jobslot();
+     code_addr p = vm_jobstub(8), q = p;
+
+     // jmp [slot]
+     *slot = s;
+     *q++ = 0xff; *q++ = 0x25;
+#ifdef M64X32
+     * (int *) q = raddr(s) - xaddr(q + 4);
+#else
+     * (unsigned *) q = (unsigned) raddr(s);
+#endif
+
+     return xaddr(p);
+}
+
 void vm_postlude(void) {
      retn();
 }
@@ -2242,6 +2672,20 @@ void vm_chain(code_addr p) {
      instr_tgt(opJMP_i, p);
 }
 
+/* vm_move -- adjust after the procedure has been moved.  Every
+   address in x86 code is recorded and fixed up by vm_relocate, and the
+   only address kept between instructions is the end of the peephole
+   fact, which no longer matches pc after a move and so is ignored; so
+   there is nothing to adjust here. */
+void vm_move(ptr delta) {
+}
+
+/* vm_dumplits -- x86 code never puts literals at the top of the buffer,
+   so there is never a pool to move */
+int vm_dumplits(code_addr lo, code_addr hi) {
+     return 0;
+}
+
 #ifdef DEBUG
 int vm_print(code_addr p) {
      printf("%02x", *p);
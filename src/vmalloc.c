@@ -29,6 +29,8 @@
  */
 
 #include "config.h"
+#include "vm.h"
+#include "vminternal.h"
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -42,7 +44,8 @@
 #endif
 
 void *vm_alloc(int size) {
-     static void *last_addr = NULL;
+     /* The address hint is kept separately by each thread */
+     static THREAD void *last_addr = NULL;
 
      // Round up to whole pages
      size = (size + PAGESIZE - 1) & ~(PAGESIZE-1);
@@ -62,6 +65,11 @@ void *vm_alloc(int size) {
      return p;
 }
 
+void vm_free(void *p, int size) {
+     size = (size + PAGESIZE - 1) & ~(PAGESIZE-1);
+     munmap(p, size);
+}
+
 #else
 
 void *vm_alloc(int size) {
@@ -76,4 +84,8 @@ void *vm_alloc(int size) {
      return mem;
 }
 
+void vm_free(void *p, int size) {
+     free(p);
+}
+
 #endif
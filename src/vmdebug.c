@@ -58,6 +58,25 @@ void vm_panic(const char *fmt, ...) {
      exit(2);
 }
 
+void (*vm_onerror)(const char *msg) = NULL;
+
+/* vm_fail -- report an error that the client may recover from */
+void vm_fail(const char *fmt, ...) {
+     static THREAD char msg[256];
+     va_list va;
+
+     va_start(va, fmt);
+     vsnprintf(msg, sizeof(msg), fmt, va);
+     va_end(va);
+
+     if (vm_onerror != NULL) {
+          vm_abandon();
+          (*vm_onerror)(msg);
+     }
+
+     vm_panic("%s", msg);
+}
+
 void vm_unknown(const char *where, operation op) {
      vm_panic("unknown op -- %s %s (%d)\n", where, mnemonic[op], op);
 }
@@ -79,7 +98,7 @@ void vm_debug1(int op, int nrands, ...) {
      va_end(va);
 }
 
-static code_addr start;
+static THREAD code_addr start;
 
 void vm_debug2(const char *fmt, ...) {
      va_list va;
@@ -87,7 +106,7 @@ void vm_debug2(const char *fmt, ...) {
      if (vm_debug < 2) return;
 
      va_start(va, fmt);
-     printf("---   %#x: ", (unsigned) (ptr) pc);
+     printf("---   %#x: ", (unsigned) (ptr) xaddr(pc));
      vprintf(fmt, va);
      va_end(va);
 
@@ -110,7 +129,7 @@ void vm_done(void) {
 }
 
 char *fmt_val(int v) {
-     static char buf[16];
+     static THREAD char buf[16];
 
      // Print offsets in decimal, addresses in hex
      
@@ -125,7 +144,7 @@ char *fmt_val(int v) {
 }
 
 char *fmt_val64(uint64 v) {
-     static char buf[32];
+     static THREAD char buf[32];
 
      if (vm_aflag)
           sprintf(buf, "<addr64>");
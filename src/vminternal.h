@@ -38,6 +38,15 @@
 
 typedef unsigned char *code_addr;
 
+/* Each thread compiles with state of its own, so that several threads
+   may compile at once; only the code allocator is shared */
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#define THREAD __thread
+#else
+#define THREAD
+#endif
+
 typedef long long int64;
 typedef unsigned long long uint64;
 
@@ -52,13 +61,36 @@ struct _vmreg {
      int vr_reg;
 };
 
+/* Virtual registers made by vm_newreg are numbered from VIRTUAL up,
+   with VM_FLOAT in the bottom bit, until the allocator replaces them */
+#define VIRTUAL 0x10000
+#define isvirtual(r) ((r)->vr_reg >= VIRTUAL)
+
+#define NPHYS 32                /* Bound on physical register numbers */
+
+struct _vmlabel {
+     int l_serial;              /* Serial number */
+     code_addr l_val;           /* Native code address */
+     struct _branch *l_branches; /* Branches waiting to be patched */
+     vmlabel l_next;            /* Next label made since vm_reset */
+     vmlabel l_alias;           /* Label that this one stands for */
+     int l_weight;              /* Count from vm_weight, or -1 */
+     int l_block;               /* Used by passes over the record */
+};
+
+/* vm_labroot -- the label that an alias finally stands for */
+vmlabel vm_labroot(vmlabel lab);
+
 #define BRANCH 1
 #define CASELAB 2
 #define ABS 3
 #define HI16 4
 #define LO16 5
+#define ABS64 6
+#define JUMP32 7                /* Jump to a label that may be shortened */
+#define JUMP8 8                 /* Jump with an 8-bit displacement */
 
-extern code_addr pc;
+extern THREAD code_addr pc;
 
 void vm_space(int space);
 void byte(int x);
@@ -70,11 +102,243 @@ void vm_postlude(void);
 void vm_chain(code_addr p);
 void vm_reset(void);
 void vm_patch(code_addr loc, code_addr lab);
+void vm_repatch(int kind, code_addr loc, code_addr val);
 void vm_branch(int kind, code_addr loc, vmlabel lab);
+void vm_install(int kind, code_addr loc, code_addr val);
+void vm_fixed(int kind, code_addr loc, code_addr val);
+void vm_relocate(code_addr lo, code_addr hi, ptr delta);
+void vm_move(ptr delta);
+int vm_dumplits(code_addr lo, code_addr hi);
 void vm_panic(const char *fmt, ...);
+void vm_fail(const char *fmt, ...);
+void vm_abandon(void);
 void vm_unknown(const char *where, operation op);
 int vm_print(code_addr p);
 int vm_tramp(funptr fun);
+code_addr vm_callthrough(code_addr *slot);
+void vm_place(vmlabel lab);
+extern THREAD code_addr vm_lastlab;
+code_addr vm_caseslot(void);
+
+/* Translation of single instructions by the back end: the vm_gen
+   functions in ir.c call these at once, or record the instructions
+   and call them at vm_end */
+void vm_enc1r(operation op, vmreg a);
+void vm_enc1i(operation op, int a);
+void vm_enc1a(operation op, void *a);
+void vm_enc1j(operation op, vmlabel lab);
+void vm_enc2rr(operation op, vmreg a, vmreg b);
+void vm_enc2ri(operation op, vmreg a, int b);
+void vm_enc2rj(operation op, vmreg a, vmlabel b);
+void vm_enc3rrr(operation op, vmreg a, vmreg b, vmreg c);
+void vm_enc3rri(operation op, vmreg a, vmreg b, int c);
+void vm_enc3rrj(operation op, vmreg a, vmreg b, vmlabel lab);
+void vm_enc3rij(operation op, vmreg a, int b, vmlabel lab);
+void vm_enc4rrrs(operation op, vmreg a, vmreg b, vmreg c, int s);
+int vm_encsite(operation op, void *a);
+
+/* Kinds of recorded instruction, named after the vm_gen functions,
+   with pseudo-instructions for labels, jump table entries and sites */
+#define IR_1R 0
+#define IR_1I 1
+#define IR_1A 2
+#define IR_1J 3
+#define IR_2RR 4
+#define IR_2RI 5
+#define IR_2RJ 6
+#define IR_3RRR 7
+#define IR_3RRI 8
+#define IR_3RRJ 9
+#define IR_3RIJ 10
+#define IR_4RRRS 11
+#define IR_LABEL 12             /* a = label */
+#define IR_CASE 13              /* a = label, b = table entry */
+#define IR_SITE 14              /* a = target */
+
+/* The instructions of a procedure compiled with vm_defer, kept as
+   parallel arrays so that a pass touches only the fields it needs.
+   Registers, labels and addresses are stored as ptr, and integers
+   cast to ptr. */
+struct ir {
+     int n;                     /* Number of instructions */
+     int max;                   /* Room in the arrays */
+     unsigned char *op;         /* Operation */
+     unsigned char *form;       /* Kind, IR_1R etc. */
+     unsigned char *s;          /* Scale for IR_4RRRS */
+     ptr *a, *b, *c;            /* Operands in order */
+};
+
+extern THREAD struct ir vm_ir;
+
+int vm_ir_begin(int n, int locs);
+void vm_ir_end(void);
+void vm_ir_drop(void);
+void vm_free_ir(void);
+struct ir *vm_ir_copy(void);
+void vm_ir_put(struct ir *r, int form, operation op,
+               ptr a, ptr b, ptr c, int s);
+void vm_ir_swap(void);
+
+/* vm_rand -- register operand w of instruction i, as 0, 1, 2 for a, b, c */
+#define vm_rand(i, w) \
+     ((vmreg) ((w) == 0 ? vm_ir.a : (w) == 1 ? vm_ir.b : vm_ir.c)[i])
+
+#define isload(op) \
+     ((op) == LDW || (op) == LDB || (op) == LDBu \
+      || (op) == LDS || (op) == LDSu || (op) == LDQ)
+#define isstore(op) \
+     ((op) == STW || (op) == STB || (op) == STS || (op) == STQ)
+#define iscall(form, op) \
+     ((op) == CALL && ((form) == IR_1R || (form) == IR_1A || (form) == IR_SITE))
+
+/* vm_operands -- find the register operands of instruction i as
+   fields 0, 1, 2 for a, b, c, and mark those that it sets; returns
+   the number of operands */
+static inline int vm_operands(int i, int which[], int def[]) {
+     int op = vm_ir.op[i], d = !isstore(op), n = 0;
+
+     switch (vm_ir.form[i]) {
+     case IR_1R:
+          d = (op == ZEROf || op == ZEROd);
+          /* Fall through */
+     case IR_2RI: case IR_2RJ:
+          which[n] = 0; def[n++] = d;
+          break;
+     case IR_3RRJ:
+          d = 0;
+          /* Fall through */
+     case IR_2RR: case IR_3RRI:
+          which[n] = 0; def[n++] = d;
+          which[n] = 1; def[n++] = 0;
+          break;
+     case IR_3RIJ:
+          which[n] = 0; def[n++] = 0;
+          break;
+     case IR_3RRR: case IR_4RRRS:
+          which[n] = 0; def[n++] = d;
+          which[n] = 1; def[n++] = 0;
+          which[n] = 2; def[n++] = 0;
+          break;
+     }
+
+     return n;
+}
+
+/* Basic blocks of the record, found by vm_ir_blocks */
+struct irblock {
+     int first, last;           /* Instructions in the block */
+     int succ[2];               /* Successors, or -1 */
+     unsigned char indirect;    /* Ends with a JUMP via a register */
+     unsigned char exit;        /* BLK_RETURN or BLK_AWAY if it leaves */
+};
+
+#define BLK_RETURN 1            /* Falls off the end of the procedure */
+#define BLK_AWAY 2              /* Ends with a JUMP that may leave */
+
+extern THREAD int vm_nblock, vm_ntaken;
+extern THREAD struct irblock *vm_block;
+extern THREAD int *vm_taken;    /* Blocks whose address is taken */
+
+/* vm_irvar -- variable for a register, or -1: a virtual register by
+   its number, and a physical register k as map[k] */
+static inline int vm_irvar(vmreg r, const int map[]) {
+     int k = r->vr_reg;
+     if (k >= VIRTUAL) return (k - VIRTUAL) >> 1;
+     if (k >= 0 && k < NPHYS) return map[k];
+     return -1;
+}
+
+void vm_ir_blocks(void);
+void vm_ir_live(int nw, const int map[], int callvar,
+                const unsigned *ret, const unsigned *away,
+                unsigned *in, unsigned *out);
+
+/* Sets as bit vectors */
+#define setbit(s, v) ((s)[(v)>>5] |= 1u << ((v)&31))
+#define clrbit(s, v) ((s)[(v)>>5] &= ~(1u << ((v)&31)))
+#define getbit(s, v) (((s)[(v)>>5] >> ((v)&31)) & 1)
+
+/* vm_fold_consts -- propagate and fold constants in the record */
+void vm_fold_consts(int nreg);
+
+/* vm_thread_jumps -- retarget branches that lead to jumps */
+void vm_thread_jumps(void);
+
+/* vm_negate -- the branch on the opposite condition */
+operation vm_negate(operation op);
+
+/* vm_layout_blocks -- put the blocks in order of frequency */
+void vm_layout_blocks(void);
+
+/* vm_dead_code -- remove unreachable blocks and unused results */
+void vm_dead_code(int nreg);
+
+/* vm_regalloc -- replace the virtual registers in the record,
+   returning the size of frame needed with spill slots */
+int vm_regalloc(int nreg, int locs);
+
+extern ptr vm_xoff, vm_doff;
+
+/* xaddr -- executable address for a location in the code buffer */
+#define xaddr(p) ((code_addr) ((ptr) (p) + vm_xoff))
+
+/* raddr -- read-only address for a location in the data buffer */
+#define raddr(p) ((code_addr) ((ptr) (p) + vm_doff))
+
+#define CODEMEM 0
+#define DATAMEM 1
+
+int vm_get_arena(int kind, code_addr *base, int *size);
+int vm_more_arena(int kind, int n, code_addr *base, int *size);
+void vm_discard(code_addr p, int size);
+void vm_sync_cores(void);
+code_addr vm_map_shared(int fd, int size, code_addr base);
+
+typedef struct _extent *extent;
+
+extent vm_getext(int kind, int size, code_addr *base, code_addr *end);
+extent vm_split(extent x, code_addr p);
+void vm_freeext(extent x);
+void vm_startproc(void);
+void vm_own(extent x);
+void vm_finishproc(code_addr entry, const char *name);
+void vm_dropproc(void);
+void vm_protect(void);
+void vm_pin(extent x);
+void vm_pinproc(void);
+void vm_fillslot(code_addr slot, void *entry);
+void vm_note(int kind, code_addr loc, code_addr val);
+int vm_notesite(int kind, code_addr loc, code_addr val);
+void vm_remap(code_addr lo, code_addr hi, ptr delta);
+
+/* References installed in the current procedure, as recorded by
+   vm_note; those at patchable sites have SITE in r_kind */
+typedef struct {
+     int r_kind;                /* BRANCH, CASELAB, ABS, ... */
+     code_addr r_loc;           /* Location of reference */
+     code_addr r_val;           /* Address referred to */
+} reloc;
+
+#define SITE 0x100
+
+reloc *vm_relocs(int *n);
+
+/* vm_shorten -- shorten jumps in the finished procedure [beg, end)
+   with entry address entry, returning the new end */
+code_addr vm_shorten(code_addr beg, code_addr end, code_addr entry);
+vm_codespace vm_shared_codespace(code_addr top[2], code_addr end[2]);
+
+/* Counters kept by the code buffer and scratch pools for vm_stats */
+extern THREAD struct vm_stats vm_count;
+void vm_countscratch(int n);
+
+void vm_dropbufs(void);
+void vm_dropslabs(void);
+void vm_free_scratch(void);
+code_addr vm_codelit(int n, int reach);
+code_addr vm_stub(int n);
+code_addr vm_jobstub(int n);
+code_addr vm_jobslot(void);
 
 char *fmt_val(int v);
 char *fmt_val64(uint64 v);
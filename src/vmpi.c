@@ -129,7 +129,7 @@ char **regname = &_regname[1];
 
 /* fmt_addr -- format an address for debugging */
 static char *fmt_addr(int rs, int imm, int op) {
-     static char buf[32];
+     static THREAD char buf[32];
 
      if (imm == 0)
 	  sprintf(buf, "[%s]", regname[rs]);
@@ -141,7 +141,7 @@ static char *fmt_addr(int rs, int imm, int op) {
 
 /* fmt_shift -- format a scaled register as part of an address */
 static char *fmt_shift(int r, int s) {
-     static char buf[16];
+     static THREAD char buf[16];
 
      if (s == 0)
           return regname[r];
@@ -279,6 +279,7 @@ Rough instruction layout:
 #define opBGT    MNEM("bgt",    opnc(condGT, 0xa0))
 #define opBHI    MNEM("bhi",    opnc(condHI, 0xa0))
 #define opBHS    MNEM("bhs",    opnc(condHS, 0xa0))
+#define opBL     MNEM("bl",     opnc(condAL, 0xb0))
 #define opBLE    MNEM("ble",    opnc(condLE, 0xa0))
 #define opBLO    MNEM("blo",    opnc(condLO, 0xa0))
 #define opBLS    MNEM("bls",    opnc(condLS, 0xa0))
@@ -543,25 +544,47 @@ static void _fmrs(OPDECL, int rd, int rn) {
 
 // LITERAL TABLE
 
+/* Literals sit at the top of the code buffer, within reach of an ldr
+   with a 12-bit offset from pc.  The loads are recorded so that the
+   pool can be moved into line if the procedure must be moved. */
+
+#define REACH 4095
+#define MAXUSES 1024
+
+static THREAD code_addr usesite[MAXUSES], useloc[MAXUSES];
+static THREAD int nuses;        /* -1 if there were too many */
+
+/* lituse -- note a load at the current pc from a literal */
+static void lituse(code_addr loc) {
+     if (nuses < 0) return;
+     if (nuses >= MAXUSES) {
+          nuses = -1;
+          return;
+     }
+     usesite[nuses] = pc; useloc[nuses++] = loc;
+}
+
 #ifndef USE_MOVW
 
 #define MAXLITS 256
 
-static int literals[MAXLITS];
-static code_addr litloc[MAXLITS];
-static int nlits;
+static THREAD int literals[MAXLITS];
+static THREAD code_addr litloc[MAXLITS];
+static THREAD int nlits;
 
 /* make_literal -- create or reuse an entry in the literal pool */
 code_addr make_literal(int val) {
      for (int i = 0; i < nlits; i++) {
-          if (literals[i] == val)
+          if (literals[i] == val && litloc[i] - pc <= REACH)
                return litloc[i];
      }
 
      if (nlits >= MAXLITS)
           vm_panic("too many literals");
      
-     code_addr loc = vm_literal(4);
+     /* NULL if the pool is out of reach */
+     code_addr loc = vm_codelit(4, REACH);
+     if (loc == NULL) return NULL;
      * (int *) loc = val;
 
      literals[nlits] = val;
@@ -571,9 +594,54 @@ code_addr make_literal(int val) {
 
 #endif
 
+/* resetlits -- forget the literal pool */
+static void resetlits(void) {
+#ifndef USE_MOVW
+     nlits = 0;
+#endif
+     nuses = 0;
+}
+
+/* vm_dumplits -- move the literals in [lo, hi) into line at pc with a
+   branch around them, and fix up the loads that use them.  Returns 0
+   if the loads could not all be recorded. */
+int vm_dumplits(code_addr lo, code_addr hi) {
+     code_addr b = pc, base;
+
+     if (nuses < 0) return 0;
+
+     branch_i(opB, 0);
+     vm_debug2("literals %d bytes\n", (int) (hi - lo));
+     base = pc;
+     memmove(base, lo, hi - lo);
+     pc = base + (hi - lo);
+     vm_patch(b, xaddr(pc));
+     vm_relocate(lo, hi, base - lo);
+
+     for (int i = 0; i < nuses; i++) {
+          int *w = (int *) usesite[i];
+          int off = useloc[i] + (base - lo) - (usesite[i] + 8);
+          *w = (*w & ~0xfff) | off;
+     }
+
+     resetlits();
+     return 1;
+}
+
+/* inline_literal -- load a literal placed in line, after a branch
+   around it; returns its location */
+static code_addr inline_literal(int r, int val) {
+     code_addr loc;
+     ldst_ri(SETBIT(opLDR, UBIT), r, PC, 0);
+     branch_i(opB, 0);
+     loc = pc;
+     word(val);
+     return loc;
+}
+
 // VIRTUAL INSTRUCTIONS
 
-static unsigned imm_field;      /* Formatted immediate field */
+static THREAD unsigned imm_field; /* Formatted immediate field */
 
 /* immediate -- try to format shifter operand and set imm_field */
 static int immediate(int imm) {
@@ -605,7 +673,12 @@ static void move_immed(int r, int imm) {
                op_ri16(opMOVT, r, imm>>16);
 #else
           code_addr loc = make_literal(imm);
-          ldst_ri(SETBIT(opLDR, UBIT), r, PC, loc - (pc+8));
+          if (loc == NULL)
+               inline_literal(r, imm);
+          else {
+               lituse(loc);
+               ldst_ri(SETBIT(opLDR, UBIT), r, PC, loc - (pc+8));
+          }
 #endif
      }
 }
@@ -667,18 +740,41 @@ static void boolcond(OPDECL, int r) {
      op_ri(OP, r, 1);
 }
 
-/* vm_patch -- patch offset into a branch */
-void vm_patch(code_addr loc, code_addr lab) {
+/* branch_to -- the branch at loc with its offset changed */
+static int branch_to(code_addr loc, code_addr lab) {
      /* Let's hope that if a branch crosses between code segments, 
         the segments have been allocated close enough to each other. */
 
-     int off = lab - loc - 8; // in bytes
+     int off = lab - xaddr(loc) - 8; // in bytes
      assert((off & 0x3) == 0);
      off >>= 2;
      if (off < -0x800000 || off >= 0x800000)
           vm_panic("branch offset out of range");
      int *p = ((int *) loc);
-     *p = (*p & ~0xffffff) | (off & 0xffffff);
+     return (*p & ~0xffffff) | (off & 0xffffff);
+}
+
+/* vm_patch -- patch offset into a branch */
+void vm_patch(code_addr loc, code_addr lab) {
+     * (int *) loc = branch_to(loc, lab);
+}
+
+/* vm_shorten -- all branches are the same size on ARM */
+code_addr vm_shorten(code_addr beg, code_addr end, code_addr entry) {
+     return end;
+}
+
+/* vm_repatch -- change a branch in code that may be running.  The
+   instruction is a single aligned word, so other threads see either
+   the old branch or the new one; then the word is cleaned from the
+   data cache and the instruction cache invalidated, with the barriers
+   that go with that. */
+void vm_repatch(int kind, code_addr loc, code_addr val) {
+     if (kind != BRANCH) vm_panic("bad patch kind");
+     __atomic_store_n((int *) loc, branch_to(loc, val), __ATOMIC_RELEASE);
+#ifdef USE_FLUSH
+     __clear_cache(xaddr(loc), xaddr(loc+4));
+#endif
 }
 
 static void branch(OPDECL, vmlabel lab) {
@@ -798,7 +894,7 @@ static void move_reg(int ra, int rb) {
      if (ra != rb) op_rr(opMOV, ra, rb);
 }
 
-static int argp;
+static THREAD int argp;
 
 static void proc_call(int ra) {
      assert(argp == 0);
@@ -808,7 +904,7 @@ static void proc_call(int ra) {
 
 // REGISTER MAP
 
-static unsigned regmap = 0;
+static THREAD unsigned regmap = 0;
 
 static void write_reg(int r) {
      if (! isfloat(r)) regmap |= bit(r);
@@ -824,7 +920,7 @@ static void write_reg(int r) {
 static void vm_load_store_ri(operation op, int ra, int rb, int c);
 static void vm_load_store_rrs(operation op, int ra, int rb, int rc, int s);
 
-void vm_gen1r(operation op, vmreg rega) {
+void vm_enc1r(operation op, vmreg rega) {
      int ra = rega->vr_reg;
 
      vm_debug1(op, 1, rega->vr_name);
@@ -856,7 +952,7 @@ void vm_gen1r(operation op, vmreg rega) {
      }
 }
 
-void vm_gen1i(operation op, int a) {
+void vm_enc1i(operation op, int a) {
      vm_debug1(op, 1, fmt_val(a));
      vm_space(0);
 
@@ -876,7 +972,7 @@ void vm_gen1i(operation op, int a) {
      }
 }
 
-void vm_gen1a(operation op, void *a) {
+void vm_enc1a(operation op, void *a) {
      vm_debug1(op, 1, fmt_val((int) a));
      vm_space(0);
 
@@ -889,7 +985,35 @@ void vm_gen1a(operation op, void *a) {
      }
 }
 
-void vm_gen1j(operation op, vmlabel lab) {
+/* vm_encsite -- CALL or JUMP to an address that can be changed later,
+   as a BL or B instruction; the target must be within 32MB */
+int vm_encsite(operation op, void *a) {
+     code_addr loc;
+
+     vm_debug1(op, 1, fmt_val((int) a));
+     vm_space(0);
+     loc = pc;
+
+     switch (op) {
+     case CALL:
+          assert(argp == 0);
+          branch_i(opBL, 0);
+          break;
+
+     case JUMP:
+          branch_i(opB, 0);
+          break;
+
+     default:
+	  badop();
+          return -1;
+     }
+
+     vm_install(BRANCH, loc, (code_addr) a);
+     return vm_notesite(BRANCH, loc, (code_addr) a);
+}
+
+void vm_enc1j(operation op, vmlabel lab) {
      vm_debug1(op, 1, fmt_lab(lab));
      vm_space(0);
 
@@ -903,7 +1027,7 @@ void vm_gen1j(operation op, vmlabel lab) {
      }
 }
 
-void vm_gen2rr(operation op, vmreg rega, vmreg regb) {
+void vm_enc2rr(operation op, vmreg rega, vmreg regb) {
      int ra = rega->vr_reg, rb = regb->vr_reg;
 
      vm_debug1(op, 2, rega->vr_name, regb->vr_name);
@@ -972,7 +1096,7 @@ void vm_gen2rr(operation op, vmreg rega, vmreg regb) {
      }
 }
 
-void vm_gen2ri(operation op, vmreg rega, int b) {
+void vm_enc2ri(operation op, vmreg rega, int b) {
      int ra = rega->vr_reg;
 
      vm_debug1(op, 2, rega->vr_name, fmt_val(b));
@@ -992,7 +1116,7 @@ void vm_gen2ri(operation op, vmreg rega, int b) {
      }
 }
 
-void vm_gen2rj(operation op, vmreg rega, vmlabel b) {
+void vm_enc2rj(operation op, vmreg rega, vmlabel b) {
      int ra = rega->vr_reg;
      code_addr r;
 
@@ -1001,8 +1125,13 @@ void vm_gen2rj(operation op, vmreg rega, vmlabel b) {
 
      switch (op) {
      case MOV:
-          r = vm_literal(4);
-          load_store(opLDR, W(ra), PC, r - (pc+8));
+          r = vm_codelit(4, REACH);
+          if (r == NULL)
+               r = inline_literal(W(ra), 0);
+          else {
+               lituse(r);
+               ldst_ri(SETBIT(opLDR, UBIT), W(ra), PC, r - (pc+8));
+          }
           vm_branch(ABS, r, b);
           break;
               
@@ -1011,7 +1140,7 @@ void vm_gen2rj(operation op, vmreg rega, vmlabel b) {
      }
 }
 
-void vm_gen3rrr(operation op, vmreg rega, vmreg regb, vmreg regc) {
+void vm_enc3rrr(operation op, vmreg rega, vmreg regb, vmreg regc) {
      int ra = rega->vr_reg, rb = regb->vr_reg, rc = regc->vr_reg;
 
      vm_debug1(op, 3, rega->vr_name, regb->vr_name, regc->vr_name);
@@ -1144,7 +1273,7 @@ static void vm_load_store_rrs(operation op, int ra, int rb, int rc, int s) {
      }
 }
 
-void vm_gen3rri(operation op, vmreg rega, vmreg regb, int c) {
+void vm_enc3rri(operation op, vmreg rega, vmreg regb, int c) {
      int ra = rega->vr_reg, rb = regb->vr_reg;
 
      vm_debug1(op, 3, rega->vr_name, regb->vr_name, fmt_val(c));
@@ -1231,7 +1360,7 @@ static void vm_load_store_ri(operation op, int ra, int rb, int c) {
      }
 }
 
-void vm_gen3rrj(operation op, vmreg rega, vmreg regb, vmlabel lab) {
+void vm_enc3rrj(operation op, vmreg rega, vmreg regb, vmlabel lab) {
      int ra = rega->vr_reg, rb = regb->vr_reg;
 
      vm_debug1(op, 3, rega->vr_name, regb->vr_name, fmt_lab(lab));
@@ -1330,7 +1459,7 @@ NZCV bits:  |1000  0110  0010  0011 |
      }
 }
 
-void vm_gen3rij(operation op, vmreg rega, int b, vmlabel lab) {
+void vm_enc3rij(operation op, vmreg rega, int b, vmlabel lab) {
      int ra = rega->vr_reg;
 
      vm_debug1(op, 3, rega->vr_name, fmt_val(b), fmt_lab(lab));
@@ -1363,7 +1492,7 @@ void vm_gen3rij(operation op, vmreg rega, int b, vmlabel lab) {
      }
 }
 
-void vm_gen4rrrs(operation op, vmreg rega, vmreg regb, vmreg regc, int s) {
+void vm_enc4rrrs(operation op, vmreg rega, vmreg regb, vmreg regc, int s) {
      int ra = rega->vr_reg, rb = regb->vr_reg, rc = regc->vr_reg;
 
      vm_debug1(op, 4, rega->vr_name, regb->vr_name, regc->vr_name, fmt_val(s));
@@ -1382,15 +1511,13 @@ void vm_gen4rrrs(operation op, vmreg rega, vmreg regb, vmreg regc, int s) {
 
 /* Prelude and postlude */
 
-static code_addr entry;
-static int locals;
+static THREAD code_addr entry;
+static THREAD int locals;
 
 void *vm_prelude(int n, int locs) {
      regmap = 0;
      locals = (locs+7)&~7;
-#ifndef USE_MOVW
-     nlits = 0;
-#endif
+     resetlits();
 
      entry = pc;
      move_reg(IP, SP);
@@ -1405,10 +1532,32 @@ void *vm_prelude(int n, int locs) {
 void vm_chain(code_addr p) {
      code_addr loc = pc;
      branch_i(opB, 0);
-     vm_patch(loc, p);
-#ifndef USE_MOVW
-     nlits = 0;
+     vm_fixed(BRANCH, loc, p);
+     resetlits();
+}
+
+/* vm_callthrough -- make a stub that jumps via a slot, which is in
+   data memory so that storing a new target does not write near code
+   that other threads are running */
+code_addr vm_callthrough(code_addr *slot) {
+     code_addr s = vm_jobslot();
+     code_addr p = vm_jobstub(12);
+
+     // ldr ip, [pc, #0]; ldr pc, [ip], with the address of the slot after
+     *slot = s;
+     * (unsigned *) p = 0xe59fc000;
+     * (unsigned *) (p+4) = 0xe59cf000;
+     * (unsigned *) (p+8) = (unsigned) raddr(s);
+#ifdef USE_FLUSH
+     __clear_cache(xaddr(p), xaddr(p+12));
 #endif
+
+     return xaddr(p);
+}
+
+/* vm_move -- adjust after the procedure has been moved */
+void vm_move(ptr delta) {
+     entry = (code_addr) ((ptr) entry + delta);
 }
 
 /* parity -- parity of a 16-bit quantity */